@@ -0,0 +1,127 @@
+//
+//  ptmp_alloc_check.c
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <signal.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+
+#include "ptmp_transport.h"
+
+/* Allocation check: CHECK_CLIENTS clients chat through a server running under
+ * ptmp_alloc_count.so. A first burst of WARMUP_MESSAGES fills the pools, the
+ * history and every thread's caches; then the count of calls to the system
+ * allocator is read, another burst of MEASURED_MESSAGES goes through, and the
+ * run fails if the count moved. Every client reads what it's sent, so no
+ * queue grows */
+#define CHECK_CLIENTS 4
+#define WARMUP_MESSAGES 3000
+#define MEASURED_MESSAGES 3000
+#define BURST_PAUSE_EVERY 50
+#define BURST_PAUSE_US 10000
+#define QUIET_MS 1000
+
+int clients[CHECK_CLIENTS];
+
+void drain(int timeout_ms) {
+    /* Read and drop whatever the server sent, until it's been quiet for timeout_ms */
+    struct pollfd fds[CHECK_CLIENTS];
+    char buffer[65536];
+    int i;
+    
+    for (i = 0; i < CHECK_CLIENTS; i++) {
+        fds[i].fd = clients[i];
+        fds[i].events = POLLIN;
+    }
+    
+    while (poll(fds, CHECK_CLIENTS, timeout_ms) > 0)
+        for (i = 0; i < CHECK_CLIENTS; i++)
+            if (fds[i].revents && recv(clients[i], buffer, sizeof(buffer), MSG_DONTWAIT) <= 0) {
+                fprintf(stderr, "The server closed client %d\n", i);
+                exit(2);
+            }
+}
+
+void burst(int count) {
+    char text[128];
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        snprintf(text, sizeof(text), "alloc check message %d with some text", i);
+        if (send_message(clients[i % CHECK_CLIENTS], text) == -1) {
+            fprintf(stderr, "Lost the server mid-burst\n");
+            exit(2);
+        }
+        
+        if (i % BURST_PAUSE_EVERY == 0) {
+            drain(0);
+            usleep(BURST_PAUSE_US);
+        }
+    }
+    
+    drain(QUIET_MS);
+}
+
+uint64_t read_count(const char *path) {
+    uint64_t count;
+    int fd = open(path, O_RDONLY);
+    
+    if (fd == -1 || pread(fd, &count, sizeof(count), 0) != sizeof(count)) {
+        perror(path);
+        exit(2);
+    }
+    
+    close(fd);
+    return count;
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc != 4) {
+        fprintf(stderr, "Usage: %s <host> <port> <count file>\n"
+                "Fails if steady-state chat makes the server call malloc. Start the server with\n"
+                "PTMP_ALLOC_COUNT=<count file> LD_PRELOAD=build/ptmp_alloc_count.so\n", argv[0]);
+        return 2;
+    }
+    
+    char username[32];
+    int i;
+    
+    signal(SIGPIPE, SIG_IGN);
+    
+    for (i = 0; i < CHECK_CLIENTS; i++) {
+        if ((clients[i] = transport_connect(argv[1], argv[2])) == -1) {
+            perror("connect");
+            return 2;
+        }
+        
+        snprintf(username, sizeof(username), "alloc%d", i);
+        send_message(clients[i], username);
+    }
+    
+    burst(WARMUP_MESSAGES);
+    uint64_t before = read_count(argv[3]);
+    
+    burst(MEASURED_MESSAGES);
+    uint64_t after = read_count(argv[3]);
+    
+    printf("%s: %llu allocator calls for %d messages after a warmup of %d\n", after == before ? "ok" : "FAIL",
+           (unsigned long long) (after - before), MEASURED_MESSAGES, WARMUP_MESSAGES);
+    
+    for (i = 0; i < CHECK_CLIENTS; i++)
+        close(clients[i]);
+    
+    return after != before;
+}
@@ -0,0 +1,58 @@
+//
+//  ptmp_alloc_count.c
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+
+/* Preloaded into a server to count its calls to the system allocator:
+ *   PTMP_ALLOC_COUNT=<file> LD_PRELOAD=build/ptmp_alloc_count.so <server> ...
+ * The count is kept as a 64-bit integer in the file itself, mapped shared, so
+ * ptmp_alloc_check can read it while the server runs. glibc only */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *buffer, size_t size);
+
+static uint64_t unmapped_calls;
+static uint64_t *calls = &unmapped_calls;
+
+__attribute__((constructor)) static void map_count(void) {
+    const char *path = getenv("PTMP_ALLOC_COUNT");
+    if (path == NULL)
+        return;
+    
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || ftruncate(fd, sizeof(uint64_t)) == -1)
+        return;
+    
+    uint64_t *mapped = mmap(NULL, sizeof(uint64_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    
+    if (mapped != MAP_FAILED) {
+        *mapped = unmapped_calls;
+        calls = mapped;
+    }
+}
+
+void *malloc(size_t size) {
+    __atomic_add_fetch(calls, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    __atomic_add_fetch(calls, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *buffer, size_t size) {
+    __atomic_add_fetch(calls, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(buffer, size);
+}
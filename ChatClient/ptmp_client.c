@@ -13,20 +13,88 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
+#include <fcntl.h>
+#include <libgen.h>
 
 #include <termios.h>
 #include <curses.h>
 
-#define LEN_FIELD_SIZE 4
+#include "ptmp_transport.h"
+
+/* Reconnect delays grow exponentially from the base up to the cap */
+#define RECONNECT_BASE_DELAY_MS 250
+#define RECONNECT_MAX_DELAY_MS 30000
+
+/* Incoming lines are drawn in batches, at most this many times per second */
+#define RENDER_FPS 30
+
+/* Scrollback arena; the cap can be given in KB as the third argument, up to
+ * SCROLLBACK_MAX_KB */
+#define SCROLLBACK_CHUNK_SIZE 65536
+#define SCROLLBACK_DEFAULT_KB 16384
+#define SCROLLBACK_MAX_KB (4 * 1024 * 1024)
+
+/* /send <path> shares a file with the room: a 0x7F 'A' <size>:<name> frame,
+ * then a frame holding the file. Received files are saved under their name */
+#define MAX_ATTACHMENT_SIZE (256 * 1024 * 1024)
+#define ATTACHMENT_CHUNK_SIZE 65536
+
+/* The server sends who is in the room as a 0x7F 'S' <version> snapshot, then
+ * 0x7F 'U' <from>:<to> deltas. Up to this many changes are shown by name */
+#define PRESENCE_NAMES_SHOWN 3
+
+/* A server publishing room chat to a multicast group sends 0x7F 'M' <group>:<port>.
+ * We join it on the interface the server is reached through and answer 0x7F 'J';
+ * the reply, 0x7F 'J' <node id>:<room seq>, ends the room chat sent over TCP.
+ * Datagrams past a gap wait here, MULTICAST_PENDING at most, while the missing
+ * room seqs are asked for with 0x7F 'N' <first>-<last>; 0x7F 'N' <last> follows
+ * the resent messages */
+#define MULTICAST_PENDING 256
+#define MULTICAST_MAX_DATAGRAM 1500
+
+typedef struct _pending_message_t {
+    char *data;
+    struct _pending_message_t *next;
+} pending_message_t;
+
+typedef struct _multicast_datagram_t {
+    uint32_t node;
+    uint32_t seq;
+    char *data; /* NULL if the slot is free */
+} multicast_datagram_t;
+
+typedef struct _render_line_t {
+    char *text;
+    struct _render_line_t *next;
+} render_line_t;
+
+typedef struct _scrollback_line_t {
+    uint32_t chunk_id; /* Absolute chunk number; its slot is chunk_id % chunk_count */
+    uint16_t offset;
+    uint16_t length;
+} scrollback_line_t;
+
+typedef struct _scrollback_t {
+    char **chunks;
+    uint32_t chunk_count;
+    uint32_t head_chunk, head_used; /* Chunk being filled and bytes used in it */
+    uint32_t tail_chunk; /* Oldest chunk still held */
+    
+    /* Line metadata, oldest at line_start; first_line is its absolute number */
+    scrollback_line_t *lines;
+    uint32_t line_start, line_end, line_capacity;
+    uint64_t first_line;
+} scrollback_t;
 
-char *process_message(int sock_fd);
-void send_message(int sock_fd, const char *buf);
 void write_in_window(WINDOW *win, int *current_line, int window_height, const char *message, ...);
 
 /* UI stuff */
@@ -34,184 +102,1084 @@ WINDOW *chat_window;
 WINDOW *input_window;
 
 int chat_height, input_height;
+int chat_width;
 int current_chat_line, current_input_line;
 
 /* Inter-thread communication variables */
 pthread_mutex_t draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Lines waiting for the next frame */
+pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+render_line_t *render_head = NULL, *render_tail = NULL;
+
+/* Everything shown in the chat window. The view follows new lines unless the
+ * user scrolled back, in which case view_end is one past the bottom line shown.
+ * Both are protected by draw_mutex */
+scrollback_t scrollback;
+int following = 1;
+uint64_t view_end;
+
+/* Connection state; the receive thread reconnects, the send thread queues meanwhile */
+pthread_mutex_t connection_mutex = PTHREAD_MUTEX_INITIALIZER;
+int sock_fd = -1, connected = 0;
+const char *server_host, *server_port;
+
+/* Room asked for in the handshake; empty for the lobby */
+const char *room_name = "";
+
+/* Who is in the room; protected by roster_mutex */
+pthread_mutex_t roster_mutex = PTHREAD_MUTEX_INITIALIZER;
+char **roster = NULL;
+int roster_count = 0, roster_size = 0;
+uint32_t roster_version = 0;
+
+/* Highest sequence number received, sent back to the server on reconnect, and the
+ * boot id of the server run that numbered it, from its 0x7F 'E' <boot id>.
+ * Protected by multicast_mutex, as datagrams advance them too */
+uint32_t last_seen_seq = 0, server_boot = 0;
+
+/* Multicast fanout state, protected by multicast_mutex. multicast_next is the room
+ * seq wanted next, 0 until the server's reply; multicast_filling is set while a gap
+ * is being resent; multicast_highest is the last room seq the group has announced */
+pthread_mutex_t multicast_mutex = PTHREAD_MUTEX_INITIALIZER;
+int multicast_fd = -1, multicast_joined = 0, multicast_filling = 0;
+uint16_t multicast_port;
+struct ip_mreq multicast_membership;
+uint32_t multicast_node, multicast_next, multicast_highest;
+multicast_datagram_t multicast_pending[MULTICAST_PENDING];
+
+/* Messages typed while disconnected, flushed in order on reconnect */
+pending_message_t *pending_head = NULL, *pending_tail = NULL;
+
 char *username;
 
 #define write_in_chat_window(m, ...) write_in_window(chat_window, &current_chat_line, chat_height, m, ##__VA_ARGS__)
 #define write_in_input_window(m, ...) write_in_window(input_window, &current_input_line, input_height, m, ##__VA_ARGS__)
 
-void pack_32i(uint32_t value, char *buffer) {
-    *buffer = value >> 24;
-    *(buffer + 1) = value >> 16;
-    *(buffer + 2) = value >> 8;
-    *(buffer + 3) = value;
+int send_handshake(int sock_fd) {
+    /* After a reconnect, the last sequence number we have seen goes after the
+     * username's NUL so the server only replays the messages we missed, with the
+     * boot id it came from so a restarted server knows it isn't one of its own.
+     * The room, if any, follows the sequence number */
+    if (last_seen_seq == 0 && room_name[0] == '\0')
+        return send_message(sock_fd, username);
+    
+    char *handshake, resume[24];
+    int handshake_len;
+    pthread_mutex_lock(&multicast_mutex);
+        if (server_boot != 0)
+            snprintf(resume, sizeof(resume), "%u:%08x", last_seen_seq, server_boot);
+        else
+            snprintf(resume, sizeof(resume), "%u", last_seen_seq);
+    pthread_mutex_unlock(&multicast_mutex);
+    
+    if (room_name[0] == '\0')
+        handshake_len = asprintf(&handshake, "%s%c%s", username, '\0', resume) + 1;
+    else
+        handshake_len = asprintf(&handshake, "%s%c%s%c%s", username, '\0', resume, '\0', room_name) + 1;
+    
+    int result = send_frame(sock_fd, handshake, handshake_len);
+    free(handshake);
+    
+    return result;
+}
+
+void write_in_window(WINDOW *win, int *current_line, int window_height, const char *message, ...) {
+    va_list args;
+    va_start(args, message);
+    wmove(win, *current_line, 1);
+    vwprintw(win, message, args);
+    va_end(args);
+    
+    if (*current_line != window_height)
+        (*current_line)++;
+    else
+        scroll(win);
+    
+    wrefresh(win);
+}
+
+void clear_window(WINDOW *win) {
+    werase(win);
+    box(win, '|', '=');
+    wrefresh(win);
 }
 
-uint32_t unpack_32i(char *buffer) {
-    return (*(buffer + 3)) | (*(buffer + 2) << 8) | (*(buffer + 1) << 16) | (*buffer << 24);
+void queue_message(const char *data) {
+    /* Called with connection_mutex held */
+    pending_message_t *message = (pending_message_t *) malloc(sizeof(pending_message_t));
+    message->data = strdup(data);
+    message->next = NULL;
+    
+    if (pending_tail)
+        pending_tail->next = message;
+    else
+        pending_head = message;
+    pending_tail = message;
 }
 
-void send_message(int sock_fd, const char *data) {
-    char *msg = NULL;
+void flush_pending_messages(void) {
+    /* Called with connection_mutex held; stops at the first failed send */
+    while (pending_head) {
+        if (send_message(sock_fd, pending_head->data) == -1)
+            return;
+        
+        pending_message_t *sent = pending_head;
+        pending_head = sent->next;
+        if (pending_head == NULL)
+            pending_tail = NULL;
+        
+        free(sent->data);
+        free(sent);
+    }
+}
+
+void sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+void queue_chat_line(const char *format, ...) {
+    /* Format the line and leave it for the render thread */
+    render_line_t *line = (render_line_t *) malloc(sizeof(render_line_t));
+    va_list args;
+    va_start(args, format);
+    vasprintf(&line->text, format, args);
+    va_end(args);
+    line->next = NULL;
+    
+    pthread_mutex_lock(&render_mutex);
+        if (render_tail)
+            render_tail->next = line;
+        else
+            render_head = line;
+        render_tail = line;
+        
+        pthread_cond_signal(&render_cond);
+    pthread_mutex_unlock(&render_mutex);
+}
+
+void scrollback_init(size_t max_bytes) {
+    /* The cap is rounded down to whole chunks, with a minimum of two */
+    scrollback.chunk_count = max_bytes / SCROLLBACK_CHUNK_SIZE;
+    if (scrollback.chunk_count < 2)
+        scrollback.chunk_count = 2;
     
-    /* Compute lengths, account for NUL in data_len */
-    uint32_t data_len = strlen(data) + 1;
-    uint32_t msg_len = data_len + LEN_FIELD_SIZE;
+    scrollback.chunks = (char **) calloc(scrollback.chunk_count, sizeof(char *));
+    scrollback.chunks[0] = (char *) malloc(SCROLLBACK_CHUNK_SIZE);
     
-    /* Allocate msg buffer and set the length */
-    msg = (char *) malloc(msg_len);
-    pack_32i(msg_len, msg);
+    scrollback.line_capacity = 1024;
+    scrollback.lines = (scrollback_line_t *) malloc(scrollback.line_capacity * sizeof(scrollback_line_t));
+}
+
+char *scrollback_chunk(uint32_t chunk_id) {
+    return scrollback.chunks[chunk_id % scrollback.chunk_count];
+}
+
+uint64_t scrollback_end(void) {
+    /* One past the absolute number of the newest line */
+    return scrollback.first_line + (scrollback.line_end - scrollback.line_start);
+}
+
+scrollback_line_t *scrollback_line(uint64_t line) {
+    return &scrollback.lines[scrollback.line_start + (line - scrollback.first_line)];
+}
+
+const char *scrollback_text(uint64_t line) {
+    scrollback_line_t *meta = scrollback_line(line);
+    return scrollback_chunk(meta->chunk_id) + meta->offset;
+}
+
+void scrollback_evict_chunk(void) {
+    /* Forget the oldest chunk and every line stored in it */
+    while (scrollback.line_start < scrollback.line_end &&
+           scrollback.lines[scrollback.line_start].chunk_id == scrollback.tail_chunk) {
+        scrollback.line_start++;
+        scrollback.first_line++;
+    }
     
-    /* Copy data to msg buffer */
-    memcpy(msg + LEN_FIELD_SIZE, data, data_len);
+    scrollback.tail_chunk++;
     
-    /* Write data to wire */
-    int bytes_written = 0, bytes_left = msg_len - bytes_written, total = 0;
-    while (bytes_left > 0) {
-        bytes_written = send(sock_fd, msg + total, bytes_left, 0);
-        bytes_left -= bytes_written;
-        total += bytes_left;
+    /* Compact the metadata once the dropped prefix dominates */
+    if (scrollback.line_start > 1024 && scrollback.line_start > scrollback.line_end / 2) {
+        memmove(scrollback.lines, scrollback.lines + scrollback.line_start,
+                (scrollback.line_end - scrollback.line_start) * sizeof(scrollback_line_t));
+        scrollback.line_end -= scrollback.line_start;
+        scrollback.line_start = 0;
     }
 }
 
-char *process_message(int sock_fd) {
-    /* Message structure:
-     * <length> <data>
-     * Length includes all of the other fields and itself. It is a 32-bit integer.
-     * Data is the data. Ignored if type == 1.
-     */
+void scrollback_append(const char *text) {
+    /* Lines never span chunks; a line longer than a chunk is truncated */
+    uint32_t len = strlen(text);
+    if (len > SCROLLBACK_CHUNK_SIZE - 1)
+        len = SCROLLBACK_CHUNK_SIZE - 1;
     
-    /* Working buffer */
-    char *sock_buf = (char *) malloc(1024);
+    if (scrollback.head_used + len + 1 > SCROLLBACK_CHUNK_SIZE) {
+        /* Pad out the current chunk so searches never match across its end */
+        memset(scrollback_chunk(scrollback.head_chunk) + scrollback.head_used, '\0',
+               SCROLLBACK_CHUNK_SIZE - scrollback.head_used);
+        
+        scrollback.head_chunk++;
+        scrollback.head_used = 0;
+        
+        /* Reuse the oldest chunk's memory once the cap is reached */
+        if (scrollback.head_chunk - scrollback.tail_chunk >= scrollback.chunk_count)
+            scrollback_evict_chunk();
+        
+        if (scrollback_chunk(scrollback.head_chunk) == NULL)
+            scrollback.chunks[scrollback.head_chunk % scrollback.chunk_count] = (char *) malloc(SCROLLBACK_CHUNK_SIZE);
+    }
     
-    /* Another buffer we'll use later for the data field */
-    char *data_buf;
+    /* Store the text NUL-terminated, so it can be drawn and searched in place */
+    memcpy(scrollback_chunk(scrollback.head_chunk) + scrollback.head_used, text, len);
+    scrollback_chunk(scrollback.head_chunk)[scrollback.head_used + len] = '\0';
     
-    /* Start by receiving LEN_FIELD_SIZE bytes to get the next message length */
-    memset(sock_buf, 0, 1024);
-    if (recv(sock_fd, sock_buf, LEN_FIELD_SIZE, 0) == 0) {
-        write_in_chat_window("[info] Connection closed\n");
-        exit(0);
+    if (scrollback.line_end == scrollback.line_capacity) {
+        scrollback.line_capacity *= 2;
+        scrollback.lines = (scrollback_line_t *) realloc(scrollback.lines, scrollback.line_capacity * sizeof(scrollback_line_t));
     }
     
-    /* Unpack length */
-    uint32_t msg_len = unpack_32i(sock_buf);
-    uint32_t data_len = msg_len - LEN_FIELD_SIZE; /* Substract 4 bytes to get the data length */
+    scrollback_line_t *meta = &scrollback.lines[scrollback.line_end++];
+    meta->chunk_id = scrollback.head_chunk;
+    meta->offset = scrollback.head_used;
+    meta->length = len;
     
-    /* Allocate another buffer for the message, take NUL into account */
-    data_buf = (char *) malloc(data_len + 1);
-    /* Various counters */
-    int bytes_read = 0, bytes_left = data_len - bytes_read, total = 0;
+    scrollback.head_used += len + 1;
+}
+
+uint64_t scrollback_line_at(uint32_t chunk_id, uint32_t offset) {
+    /* Binary search for the line containing a byte of the arena */
+    uint32_t low = scrollback.line_start, high = scrollback.line_end - 1;
     
-    while (bytes_left > 0) {
-        bytes_read = recv(sock_fd, sock_buf, 1024, 0);
+    while (low < high) {
+        uint32_t mid = low + (high - low + 1) / 2;
+        scrollback_line_t *meta = &scrollback.lines[mid];
         
-        memcpy(data_buf + total, sock_buf, bytes_read);
+        if (meta->chunk_id < chunk_id || (meta->chunk_id == chunk_id && meta->offset <= offset))
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    
+    return scrollback.first_line + (low - scrollback.line_start);
+}
+
+int64_t scrollback_search(const char *needle, uint64_t before_line) {
+    /* Newest line older than before_line that contains needle, or -1.
+     * Scans the arena chunk by chunk with memmem instead of walking lines */
+    size_t needle_len = strlen(needle);
+    
+    if (before_line > scrollback_end())
+        before_line = scrollback_end();
+    
+    if (needle_len == 0 || before_line <= scrollback.first_line)
+        return -1;
+    
+    uint32_t chunk_id = scrollback_line(before_line - 1)->chunk_id;
+    
+    while (1) {
+        char *chunk = scrollback_chunk(chunk_id);
+        size_t used = chunk_id == scrollback.head_chunk ? scrollback.head_used : SCROLLBACK_CHUNK_SIZE;
+        int64_t found = -1;
+        char *match = chunk;
+        
+        while ((match = memmem(match, used - (match - chunk), needle, needle_len)) != NULL) {
+            uint64_t line = scrollback_line_at(chunk_id, match - chunk);
+            if (line >= before_line)
+                break;
+            
+            found = line;
+            
+            /* Skip to the next line */
+            scrollback_line_t *meta = scrollback_line(line);
+            match = chunk + meta->offset + meta->length + 1;
+            if (match >= chunk + used)
+                break;
+        }
+        
+        if (found != -1 || chunk_id == scrollback.tail_chunk)
+            return found;
+        
+        chunk_id--;
+    }
+}
+
+int line_rows(int len, int width) {
+    /* Number of window rows a line wraps to */
+    return len == 0 ? 1 : (len + width - 1) / width;
+}
+
+void draw_text_rows(const char *text, int len, int *skip_rows) {
+    /* Draw a line at the current chat line, scrolling as needed. Called with draw_mutex held */
+    int width = chat_width - 2, rows = line_rows(len, width), row;
+    
+    for (row = 0; row < rows; row++, (*skip_rows)--) {
+        if (*skip_rows > 0)
+            continue;
         
-        bytes_left -= bytes_read;
-        total += bytes_read;
+        if (current_chat_line > chat_height - 2) {
+            scroll(chat_window);
+            current_chat_line = chat_height - 2;
+        }
+        
+        mvwaddnstr(chat_window, current_chat_line, 1, text + row * width, width);
+        current_chat_line++;
+    }
+}
+
+void draw_chat_lines(render_line_t *lines) {
+    /* Store a batch in the scrollback and, unless the user scrolled back, draw it
+     * into the chat window without refreshing it. Called with draw_mutex held */
+    int width = chat_width - 2, visible_rows = chat_height - 2;
+    int total_rows = 0;
+    render_line_t *line;
+    
+    for (line = lines; line; line = line->next) {
+        scrollback_append(line->text);
+        total_rows += line_rows(strlen(line->text), width);
     }
     
-    /* Add NUL-terminator */
-    data_buf[total] = '\0';
+    if (!following)
+        return;
     
-    /* Free socket buffer */
-    free(sock_buf);
+    /* Rows that would scroll out of view before the frame is shown are never drawn */
+    int skip_rows = total_rows > visible_rows ? total_rows - visible_rows : 0;
     
-    return data_buf;
+    for (line = lines; line; line = line->next)
+        draw_text_rows(line->text, strlen(line->text), &skip_rows);
 }
 
-int connect_client(const char *host, const char *port) {
-    int sock_fd;
-    struct addrinfo hints, *result;
+void draw_scrollback_view(void) {
+    /* Redraw the chat window from the scrollback. Only the lines that fit on
+     * screen are visited, however long the scrollback is. Called with draw_mutex held */
+    int width = chat_width - 2, visible_rows = chat_height - 2;
+    uint64_t end = following ? scrollback_end() : view_end, line;
+    int rows = 0;
     
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
+    if (end > scrollback_end())
+        end = scrollback_end();
     
-    getaddrinfo(host, port, &hints, &result);
+    /* The view may have been evicted; show the oldest line we still have */
+    if (end <= scrollback.first_line && scrollback_end() > scrollback.first_line)
+        end = scrollback.first_line + 1;
+    if (!following)
+        view_end = end;
     
-    sock_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (connect(sock_fd, result->ai_addr, result->ai_addrlen) == -1) {
-        perror("connect");
-        exit(-1);
+    /* Walk back from the bottom line until the window is full */
+    line = end;
+    while (line > scrollback.first_line && rows < visible_rows) {
+        line--;
+        rows += line_rows(scrollback_line(line)->length, width);
     }
     
-    write_in_chat_window("[info] Connected\n");
+    werase(chat_window);
+    box(chat_window, '|', '=');
+    current_chat_line = 1;
     
-    freeaddrinfo(result);
+    /* The top line may only partially fit */
+    int skip_rows = rows > visible_rows ? rows - visible_rows : 0;
+    for (; line < end; line++)
+        draw_text_rows(scrollback_text(line), scrollback_line(line)->length, &skip_rows);
     
-    return sock_fd;
+    wnoutrefresh(chat_window);
 }
 
-void write_in_window(WINDOW *win, int *current_line, int window_height, const char *message, ...) {
+int send_attachment(const char *path) {
+    /* Announce the file, then send it as one frame read in chunks.
+     * Returns -1 if it can't be read or the connection is down */
+    struct stat file_stat;
+    int file_fd = open(path, O_RDONLY), result = 0;
+    
+    if (file_fd == -1 || fstat(file_fd, &file_stat) == -1 || !S_ISREG(file_stat.st_mode) ||
+        file_stat.st_size > MAX_ATTACHMENT_SIZE) {
+        if (file_fd != -1)
+            close(file_fd);
+        return -1;
+    }
+    
+    uint32_t size = (uint32_t) file_stat.st_size;
+    char *path_copy = strdup(path);
+    char *metadata, header[LEN_FIELD_SIZE];
+    asprintf(&metadata, "\x7f" "A%u:%s", size, basename(path_copy));
+    pack_32i(size + LEN_FIELD_SIZE, header);
+    
+    char *chunk = malloc(ATTACHMENT_CHUNK_SIZE);
+    
+    /* Nothing else may be sent on the socket in between */
+    pthread_mutex_lock(&connection_mutex);
+        if (!connected || send_message(sock_fd, metadata) == -1 || send_all(sock_fd, header, LEN_FIELD_SIZE) == -1) {
+            result = -1;
+        } else {
+            uint32_t left = size;
+            while (left > 0 && result == 0) {
+                ssize_t len = read(file_fd, chunk, left < ATTACHMENT_CHUNK_SIZE ? left : ATTACHMENT_CHUNK_SIZE);
+                
+                /* The length was promised already; a file that shrank ends the connection */
+                if (len <= 0 || send_all(sock_fd, chunk, len) == -1) {
+                    shutdown(sock_fd, SHUT_RDWR);
+                    result = -1;
+                } else {
+                    left -= len;
+                }
+            }
+        }
+    pthread_mutex_unlock(&connection_mutex);
+    
+    free(chunk);
+    free(metadata);
+    free(path_copy);
+    close(file_fd);
+    
+    return result;
+}
+
+void save_attachment(const char *metadata, const char *body, uint32_t body_len) {
+    /* Save under the sender's file name, without its directories, never over an existing file */
+    uint32_t size;
+    const char *name = strchr(metadata, ':');
+    
+    if (sscanf(metadata + 2, "%u:", &size) != 1 || name == NULL || size != body_len) {
+        queue_chat_line("[info] Dropped a malformed attachment");
+        return;
+    }
+    
+    char *name_copy = strdup(name + 1);
+    char *file_name = basename(name_copy);
+    int file_fd = open(file_name, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    
+    if (file_fd == -1 || write(file_fd, body, body_len) != body_len)
+        queue_chat_line("[info] Couldn't save attachment %s", file_name);
+    else
+        queue_chat_line("[info] Saved attachment %s (%u bytes)", file_name, body_len);
+    
+    if (file_fd != -1)
+        close(file_fd);
+    free(name_copy);
+}
+
+void apply_presence(char *frame) {
+    /* A snapshot has a "\n<name>" line per client and replaces the roster. A delta
+     * has "\n+<name>" and "\n-<name>" lines and only applies on top of its from
+     * version; a delta for an older roster is dropped, as a new snapshot is coming */
+    char *save, *line = strtok_r(frame + 2, "\n", &save);
+    int changes = 0, i;
+    
+    if (line == NULL)
+        return;
+    
+    pthread_mutex_lock(&roster_mutex);
+        if (frame[1] == 'S') {
+            for (i = 0; i < roster_count; i++)
+                free(roster[i]);
+            roster_count = 0;
+            roster_version = (uint32_t) strtoul(line, NULL, 10);
+        } else {
+            uint32_t from, to;
+            if (sscanf(line, "%u:%u", &from, &to) != 2 || from != roster_version) {
+                pthread_mutex_unlock(&roster_mutex);
+                return;
+            }
+            roster_version = to;
+        }
+        
+        while ((line = strtok_r(NULL, "\n", &save)) != NULL) {
+            const char *name = frame[1] == 'S' ? line : line + 1;
+            
+            if (frame[1] == 'S' || line[0] == '+') {
+                if (roster_count == roster_size) {
+                    roster_size = roster_size ? 2 * roster_size : 16;
+                    roster = (char **) realloc(roster, roster_size * sizeof(char *));
+                }
+                roster[roster_count++] = strdup(name);
+            } else {
+                for (i = 0; i < roster_count && strcmp(roster[i], name) != 0; i++)
+                    ;
+                if (i < roster_count) {
+                    free(roster[i]);
+                    roster[i] = roster[--roster_count];
+                }
+            }
+            
+            /* Name the first few changes; a burst is summed up below */
+            if (frame[1] == 'U' && ++changes <= PRESENCE_NAMES_SHOWN)
+                queue_chat_line("[info] %s %s", name, line[0] == '+' ? "joined" : "left");
+        }
+        
+        if (changes > PRESENCE_NAMES_SHOWN)
+            queue_chat_line("[info] ...and %d more changes, %d in the room", changes - PRESENCE_NAMES_SHOWN, roster_count);
+    pthread_mutex_unlock(&roster_mutex);
+}
+
+void send_control(const char *format, ...) {
+    /* Send a control frame to the server, if connected. Any thread may call this */
+    char *request;
     va_list args;
-    va_start(args, message);
-    wmove(win, *current_line, 1);
-    vwprintw(win, message, args);
+    va_start(args, format);
+    vasprintf(&request, format, args);
     va_end(args);
     
-    if (*current_line != window_height)
-        (*current_line)++;
-    else
-        scroll(win);
+    pthread_mutex_lock(&connection_mutex);
+        if (connected)
+            send_message(sock_fd, request);
+    pthread_mutex_unlock(&connection_mutex);
     
-    wrefresh(win);
+    free(request);
 }
 
-void clear_window(WINDOW *win) {
-    werase(win);
-    box(win, '|', '=');
-    wrefresh(win);
+void multicast_drop_pending(uint32_t node, uint32_t below) {
+    /* Free the held datagrams from other nodes or numbered under below.
+     * Called with multicast_mutex held */
+    int i;
+    
+    for (i = 0; i < MULTICAST_PENDING; i++)
+        if (multicast_pending[i].data != NULL &&
+            (multicast_pending[i].node != node || multicast_pending[i].seq < below)) {
+            free(multicast_pending[i].data);
+            multicast_pending[i].data = NULL;
+        }
+}
+
+void multicast_advance(void) {
+    /* Show the held datagrams that are next in line, then ask for the first gap.
+     * Called with multicast_mutex held */
+    if (multicast_next == 0 || multicast_filling)
+        return;
+    
+    multicast_datagram_t *slot;
+    while ((slot = &multicast_pending[multicast_next % MULTICAST_PENDING])->data != NULL &&
+           slot->seq == multicast_next) {
+        /* <username>\0<room>\0<data>\0<seq>\0; our own messages are on screen already */
+        char *room = slot->data + strlen(slot->data) + 1;
+        char *text = room + strlen(room) + 1;
+        uint32_t seq = (uint32_t) strtoul(text + strlen(text) + 1, NULL, 10);
+        
+        if (seq > last_seen_seq) {
+            last_seen_seq = seq;
+            if (strcmp(slot->data, username) != 0)
+                queue_chat_line("%s", text);
+        }
+        
+        free(slot->data);
+        slot->data = NULL;
+        multicast_next++;
+    }
+    
+    if (multicast_highest < multicast_next)
+        return;
+    
+    /* Up to the next datagram we hold, or the last one announced */
+    uint32_t last = multicast_next;
+    while (last < multicast_highest && last - multicast_next < MULTICAST_PENDING - 1 &&
+           !(multicast_pending[(last + 1) % MULTICAST_PENDING].data != NULL &&
+             multicast_pending[(last + 1) % MULTICAST_PENDING].seq == last + 1))
+        last++;
+    
+    multicast_filling = 1;
+    send_control("\x7fN%u-%u", multicast_next, last);
+}
+
+void multicast_leave(void) {
+    /* Stop taking datagrams, until the next 0x7F 'M'. Only the receive thread calls this */
+    pthread_mutex_lock(&multicast_mutex);
+        if (multicast_joined)
+            setsockopt(multicast_fd, IPPROTO_IP, IP_DROP_MEMBERSHIP, &multicast_membership, sizeof(multicast_membership));
+        
+        multicast_joined = multicast_filling = 0;
+        multicast_node = multicast_next = multicast_highest = 0;
+        multicast_drop_pending(0, UINT32_MAX);
+    pthread_mutex_unlock(&multicast_mutex);
+}
+
+void *multicast_thread_loop(void *unused) {
+    /* Receive datagrams for our room from the group, and hold or show them.
+     * A datagram is <node id><room seq><username>\0<room>\0, then <data>\0<seq>\0
+     * unless it only announces the room seq */
+    char buffer[MULTICAST_MAX_DATAGRAM];
+    
+    while (1) {
+        int len = recv(multicast_fd, buffer, sizeof(buffer), 0);
+        if (len <= 8 || buffer[len - 1] != '\0')
+            continue;
+        
+        uint32_t node = unpack_32i(buffer), seq = unpack_32i(buffer + 4);
+        char *room = buffer + 8 + strlen(buffer + 8) + 1;
+        if (room >= buffer + len || strcmp(room, room_name) != 0)
+            continue;
+        
+        char *text = room + strlen(room) + 1;
+        int heartbeat = text == buffer + len;
+        if (!heartbeat && (text + strlen(text) + 1 >= buffer + len))
+            continue;
+        
+        pthread_mutex_lock(&multicast_mutex);
+            /* Before the reply we don't know which server is ours; hold everything */
+            if (multicast_joined && (multicast_next == 0 || node == multicast_node)) {
+                if (multicast_next != 0 && seq > multicast_highest)
+                    multicast_highest = seq;
+                
+                multicast_datagram_t *slot = &multicast_pending[seq % MULTICAST_PENDING];
+                if (!heartbeat && seq >= multicast_next && slot->data == NULL) {
+                    slot->node = node;
+                    slot->seq = seq;
+                    slot->data = (char *) malloc(len - 8);
+                    memcpy(slot->data, buffer + 8, len - 8);
+                }
+                
+                multicast_advance();
+            }
+        pthread_mutex_unlock(&multicast_mutex);
+    }
+    
+    return NULL;
+}
+
+void multicast_join(const char *group_spec) {
+    /* Join the group for 0x7F 'M' <group>:<port> and tell the server. Without
+     * multicast here, or with another port than before, we stay on TCP.
+     * Only the receive thread calls this */
+    char group[INET_ADDRSTRLEN];
+    const char *port = strrchr(group_spec, ':');
+    struct sockaddr_in local_address;
+    socklen_t address_len = sizeof(local_address);
+    
+    multicast_leave();
+    
+    if (port == NULL || port - group_spec >= sizeof(group))
+        return;
+    memcpy(group, group_spec, port - group_spec);
+    group[port - group_spec] = '\0';
+    
+    pthread_mutex_lock(&multicast_mutex);
+        if (multicast_fd == -1) {
+            struct sockaddr_in bind_address;
+            int reuse = 1;
+            
+            memset(&bind_address, 0, sizeof(bind_address));
+            bind_address.sin_family = AF_INET;
+            bind_address.sin_addr.s_addr = htonl(INADDR_ANY);
+            bind_address.sin_port = htons(atoi(port + 1));
+            
+            /* Several clients on one host share the port */
+            int fd = socket(AF_INET, SOCK_DGRAM, 0);
+            if (fd != -1 &&
+                (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) == -1 ||
+                 bind(fd, (struct sockaddr *) &bind_address, sizeof(bind_address)) == -1)) {
+                close(fd);
+                fd = -1;
+            }
+            
+            if (fd != -1) {
+                pthread_t multicast_thread;
+                multicast_fd = fd;
+                multicast_port = atoi(port + 1);
+                pthread_create(&multicast_thread, NULL, multicast_thread_loop, NULL);
+            }
+        }
+        
+        /* The interface we reach the server through is on its LAN */
+        memset(&multicast_membership, 0, sizeof(multicast_membership));
+        multicast_membership.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (getsockname(sock_fd, (struct sockaddr *) &local_address, &address_len) == 0 &&
+            local_address.sin_family == AF_INET)
+            multicast_membership.imr_interface = local_address.sin_addr;
+        
+        multicast_joined = multicast_fd != -1 && multicast_port == atoi(port + 1) &&
+                           inet_pton(AF_INET, group, &multicast_membership.imr_multiaddr) == 1 &&
+                           setsockopt(multicast_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                                      &multicast_membership, sizeof(multicast_membership)) == 0;
+    pthread_mutex_unlock(&multicast_mutex);
+    
+    if (multicast_joined)
+        send_control("\x7fJ");
+}
+
+void multicast_reply(const char *frame) {
+    /* 0x7F 'J' <node id>:<room seq> starts the datagrams after room seq;
+     * 0x7F 'N' <last> ends a resent gap */
+    uint32_t node, seq;
+    
+    pthread_mutex_lock(&multicast_mutex);
+        if (frame[1] == 'J' && sscanf(frame + 2, "%x:%u", &node, &seq) == 2) {
+            multicast_node = node;
+            multicast_next = seq + 1;
+            multicast_drop_pending(node, multicast_next);
+            
+            int i;
+            for (i = 0; i < MULTICAST_PENDING; i++)
+                if (multicast_pending[i].data != NULL && multicast_pending[i].seq > multicast_highest)
+                    multicast_highest = multicast_pending[i].seq;
+        } else if (frame[1] == 'N' && sscanf(frame + 2, "%u", &seq) == 1 && multicast_filling) {
+            if (seq >= multicast_next)
+                multicast_next = seq + 1;
+            multicast_drop_pending(multicast_node, multicast_next);
+            multicast_filling = 0;
+        }
+        
+        multicast_advance();
+    pthread_mutex_unlock(&multicast_mutex);
+}
+
+int handle_command(const char *input) {
+    /* Scrollback commands, handled locally and never sent:
+     * /up, /down - scroll a page; /end - follow new lines again;
+     * /find <text> - jump to the previous line containing text;
+     * /send <path> - share a file with the room;
+     * /msg <username> <text> - send text to that user only;
+     * /who - list who is in the room
+     * Returns 0 if input isn't a command.
+     */
+    int page = chat_height - 2;
+    
+    if (strcmp(input, "/who") == 0) {
+        pthread_mutex_lock(&roster_mutex);
+            size_t len = 32;
+            int i;
+            for (i = 0; i < roster_count; i++)
+                len += strlen(roster[i]) + 2;
+            
+            char *names = (char *) malloc(len);
+            len = sprintf(names, "[info] %d in the room:", roster_count);
+            for (i = 0; i < roster_count; i++)
+                len += sprintf(names + len, "%s %s", i ? "," : "", roster[i]);
+        pthread_mutex_unlock(&roster_mutex);
+        
+        queue_chat_line("%s", names);
+        free(names);
+        
+        pthread_mutex_lock(&draw_mutex);
+            clear_window(input_window);
+        pthread_mutex_unlock(&draw_mutex);
+        
+        return 1;
+    }
+    
+    /* /msg <username> <text> goes out as 0x7F 'D' <username> <text> */
+    if (strncmp(input, "/msg ", 5) == 0 && strchr(input + 5, ' ') != NULL) {
+        const char *text = strchr(input + 5, ' ');
+        char *request;
+        asprintf(&request, "\x7f" "D%s", input + 5);
+        
+        pthread_mutex_lock(&connection_mutex);
+            if (!connected || send_message(sock_fd, request) == -1)
+                queue_message(request);
+        pthread_mutex_unlock(&connection_mutex);
+        
+        queue_chat_line("[%s -> %.*s] %s", username, (int) (text - input - 5), input + 5, text + 1);
+        
+        pthread_mutex_lock(&draw_mutex);
+            clear_window(input_window);
+        pthread_mutex_unlock(&draw_mutex);
+        
+        free(request);
+        return 1;
+    }
+    
+    /* /send <path> shares a file */
+    if (strncmp(input, "/send ", 6) == 0) {
+        if (send_attachment(input + 6) == -1)
+            queue_chat_line("[info] Couldn't send %s", input + 6);
+        else
+            queue_chat_line("[info] Sent %s", input + 6);
+        
+        pthread_mutex_lock(&draw_mutex);
+            clear_window(input_window);
+        pthread_mutex_unlock(&draw_mutex);
+        
+        return 1;
+    }
+    
+    if (strcmp(input, "/up") && strcmp(input, "/down") && strcmp(input, "/end") && strncmp(input, "/find ", 6))
+        return 0;
+    
+    pthread_mutex_lock(&draw_mutex);
+        uint64_t end = following ? scrollback_end() : view_end;
+        
+        if (strcmp(input, "/up") == 0) {
+            end = end > scrollback.first_line + page ? end - page : scrollback.first_line + 1;
+            following = 0;
+        } else if (strcmp(input, "/down") == 0) {
+            end += page;
+            following = end >= scrollback_end();
+        } else if (strcmp(input, "/end") == 0) {
+            following = 1;
+        } else {
+            /* Search older than the bottom line, so repeating it walks back */
+            int64_t found = scrollback_search(input + 6, end > scrollback.first_line ? end - 1 : end);
+            
+            if (found == -1) {
+                beep();
+            } else {
+                end = found + 1;
+                following = 0;
+            }
+        }
+        
+        view_end = end;
+        draw_scrollback_view();
+        
+        clear_window(input_window);
+    pthread_mutex_unlock(&draw_mutex);
+    
+    return 1;
+}
+
+void *render_thread_loop(void *unused) {
+    /* Wait for queued lines;
+     * Take the whole batch;
+     * Acquire draw mutex, draw, push one update to the terminal, release;
+     * Sleep out the rest of the frame
+     */
+    while (1) {
+        pthread_mutex_lock(&render_mutex);
+            while (render_head == NULL)
+                pthread_cond_wait(&render_cond, &render_mutex);
+            
+            render_line_t *batch = render_head;
+            render_head = render_tail = NULL;
+        pthread_mutex_unlock(&render_mutex);
+        
+        pthread_mutex_lock(&draw_mutex);
+            draw_chat_lines(batch);
+            
+            /* Input window last, so the cursor stays where the user is typing */
+            wnoutrefresh(chat_window);
+            wnoutrefresh(input_window);
+            doupdate();
+        pthread_mutex_unlock(&draw_mutex);
+        
+        while (batch) {
+            render_line_t *next = batch->next;
+            free(batch->text);
+            free(batch);
+            batch = next;
+        }
+        
+        /* Cap the frame rate; whatever arrives meanwhile goes into the next batch */
+        sleep_ms(1000 / RENDER_FPS);
+    }
+}
+
+long backoff_delay(int attempt) {
+    /* Full jitter: a random delay up to the exponential bound, so clients
+     * dropped by a server restart don't all come back at the same moment */
+    long bound = RECONNECT_MAX_DELAY_MS;
+    if (attempt < 16 && (RECONNECT_BASE_DELAY_MS << attempt) < RECONNECT_MAX_DELAY_MS)
+        bound = RECONNECT_BASE_DELAY_MS << attempt;
+    
+    return random() % (bound + 1);
+}
+
+void reconnect(void) {
+    /* Only the receive thread calls this, so it is the only writer of sock_fd */
+    pthread_mutex_lock(&connection_mutex);
+        connected = 0;
+        close(sock_fd);
+    pthread_mutex_unlock(&connection_mutex);
+    
+    /* The new connection offers the group again, if there is one */
+    multicast_leave();
+    
+    queue_chat_line("[info] Connection closed, reconnecting");
+    
+    int attempt = 0, new_sock_fd = -1;
+    while (new_sock_fd == -1) {
+        sleep_ms(backoff_delay(attempt++));
+        
+        new_sock_fd = transport_connect(server_host, server_port);
+        if (new_sock_fd != -1 && send_handshake(new_sock_fd) == -1) {
+            close(new_sock_fd);
+            new_sock_fd = -1;
+        }
+    }
+    
+    pthread_mutex_lock(&connection_mutex);
+        sock_fd = new_sock_fd;
+        flush_pending_messages();
+        connected = 1;
+    pthread_mutex_unlock(&connection_mutex);
+    
+    queue_chat_line("[info] Reconnected");
 }
 
-void *send_thread_loop(void *sock_fd_ptr) {
+void *send_thread_loop(void *unused) {
     /* Wait for user input;
      * Assemble message;
-     * Send;
-     * Acquire draw mutex, draw, release
+     * Send, or queue it if the connection is down;
+     * Queue the line for the render thread;
+     * Acquire draw mutex, clear input, release
      * Repeat
      */
     char *input_buffer = (char *) malloc(1024);
     char *formatted_data;
-    int sock_fd = *((int *) sock_fd_ptr);
     
     while (1) {
         memset(input_buffer, 0, 1024);
         mvwgetstr(input_window, current_input_line, 1, input_buffer);
         
+        if (handle_command(input_buffer))
+            continue;
+        
         asprintf(&formatted_data, "[%s] %s", username, input_buffer);
         
-        send_message(sock_fd, formatted_data);
+        pthread_mutex_lock(&connection_mutex);
+            if (!connected || send_message(sock_fd, formatted_data) == -1)
+                queue_message(formatted_data);
+        pthread_mutex_unlock(&connection_mutex);
+        
+        queue_chat_line("%s", formatted_data);
         
         pthread_mutex_lock(&draw_mutex);
-            write_in_chat_window(formatted_data);
             clear_window(input_window);
         pthread_mutex_unlock(&draw_mutex);
+        
+        free(formatted_data);
     }
     
     free(input_buffer);
-    free(formatted_data);
 }
 
-void *receive_thread_loop(void *sock_fd_ptr) {
-    /* process_message
-     * Acquire draw mutex, draw, release
+void handle_chat_frame(const char *frame, uint32_t frame_len) {
+    /* Room chat and the server's multicast replies, on their own or out of a batch */
+    if (frame[0] == '\x7f' && (frame[1] == 'J' || frame[1] == 'N')) {
+        multicast_reply(frame);
+        return;
+    }
+    
+    /* The server's boot id comes before any numbered message; a new one means it
+     * restarted and numbers from 1 again */
+    if (frame[0] == '\x7f' && frame[1] == 'E') {
+        uint32_t boot = (uint32_t) strtoul(frame + 2, NULL, 16);
+        
+        pthread_mutex_lock(&multicast_mutex);
+            if (boot != server_boot) {
+                last_seen_seq = 0;
+                server_boot = boot;
+            }
+        pthread_mutex_unlock(&multicast_mutex);
+        return;
+    }
+    
+    /* Servers that number messages put the sequence number after the NUL */
+    uint32_t msg_len = strlen(frame) + 1;
+    if (frame_len > msg_len) {
+        uint32_t seq = (uint32_t) strtoul(frame + msg_len, NULL, 10);
+        
+        /* Already seen, e.g. replayed twice around a reconnect */
+        pthread_mutex_lock(&multicast_mutex);
+            int seen = seq <= last_seen_seq;
+            if (!seen)
+                last_seen_seq = seq;
+        pthread_mutex_unlock(&multicast_mutex);
+        
+        if (seen)
+            return;
+    }
+    
+    queue_chat_line("%s", frame);
+}
+
+void unpack_batch(const char *batch, uint32_t batch_len) {
+    /* 0x7F 'B', then <16-bit length><data> for each frame; each data ends in a NUL */
+    uint32_t offset = 2;
+    
+    while (offset + 2 <= batch_len) {
+        uint16_t len = unpack_16i(batch + offset);
+        const char *frame = batch + offset + 2;
+        
+        if (len == 0 || offset + 2 + len > batch_len || frame[len - 1] != '\0')
+            break;
+        
+        handle_chat_frame(frame, len);
+        offset += 2 + len;
+    }
+}
+
+void *receive_thread_loop(void *unused) {
+    /* process_message, reconnect if the connection dropped
+     * Queue the line for the render thread
      * Repeat
      */
-    int sock_fd = *((int *) sock_fd_ptr);
+    uint32_t frame_len;
+    char redirect_target[64];
     
     while (1) {
-        char *rcvd_msg = process_message(sock_fd);
+        char *rcvd_msg = process_frame(sock_fd, &frame_len);
+        if (rcvd_msg == NULL) {
+            reconnect();
+            continue;
+        }
         
-        pthread_mutex_lock(&draw_mutex);
-            write_in_chat_window(rcvd_msg);
-        pthread_mutex_unlock(&draw_mutex);
+        /* The room lives on another node: 0x7F 'R' host:port. Sequence numbers
+         * are per node, so start over there */
+        char *port = strrchr(rcvd_msg, ':');
+        if (rcvd_msg[0] == '\x7f' && rcvd_msg[1] == 'R' && port != NULL && strlen(rcvd_msg) < sizeof(redirect_target) + 2) {
+            strcpy(redirect_target, rcvd_msg + 2);
+            redirect_target[port - rcvd_msg - 2] = '\0';
+            server_host = redirect_target;
+            server_port = redirect_target + (port - rcvd_msg - 1);
+            multicast_leave();
+            
+            pthread_mutex_lock(&multicast_mutex);
+                last_seen_seq = 0;
+                server_boot = 0;
+            pthread_mutex_unlock(&multicast_mutex);
+            
+            queue_chat_line("[info] Room %s is on %s:%s", room_name, server_host, server_port);
+            
+            free(rcvd_msg);
+            reconnect();
+            continue;
+        }
+        
+        /* Who is in the room */
+        if (rcvd_msg[0] == '\x7f' && (rcvd_msg[1] == 'S' || rcvd_msg[1] == 'U')) {
+            apply_presence(rcvd_msg);
+            free(rcvd_msg);
+            continue;
+        }
+        
+        /* Multicast fanout: the group to join, and the server's replies */
+        if (rcvd_msg[0] == '\x7f' && rcvd_msg[1] == 'M') {
+            multicast_join(rcvd_msg + 2);
+            free(rcvd_msg);
+            continue;
+        }
+        
+        /* An attachment: the file itself is the next frame */
+        if (rcvd_msg[0] == '\x7f' && rcvd_msg[1] == 'A') {
+            uint32_t body_len;
+            char *body = process_frame(sock_fd, &body_len);
+            
+            if (body == NULL) {
+                free(rcvd_msg);
+                reconnect();
+                continue;
+            }
+            
+            save_attachment(rcvd_msg, body, body_len);
+            
+            free(body);
+            free(rcvd_msg);
+            continue;
+        }
+        
+        /* Batch frames: answer the empty one that offers them, and the chat that
+         * piled up for us comes in one frame from then on */
+        if (rcvd_msg[0] == '\x7f' && rcvd_msg[1] == 'B') {
+            if (frame_len == 2)
+                send_control("\x7f" "B");
+            else
+                unpack_batch(rcvd_msg, frame_len);
+            
+            free(rcvd_msg);
+            continue;
+        }
+        
+        handle_chat_frame(rcvd_msg, frame_len);
         
         free(rcvd_msg);
     }
@@ -228,6 +1196,7 @@ int main(int argc, const char * argv[]) {
     /* Set top and bottom window sizes */
     chat_height = max_y * (8.0f/10.0f);
     input_height = max_y * (2.0f/10.0f);
+    chat_width = max_x;
     
     chat_window = newwin(chat_height, max_x, 0, 0);
     input_window = newwin(input_height, max_x, chat_height, 0);
@@ -251,29 +1220,59 @@ int main(int argc, const char * argv[]) {
     wrefresh(chat_window);
     wrefresh(input_window);
     
-    if (argc == 3) {
+    if (argc >= 3 && argc <= 5) {
+        /* Keep at most this much chat history */
+        long scrollback_kb = argc >= 4 ? atol(argv[3]) : SCROLLBACK_DEFAULT_KB;
+        if (scrollback_kb <= 0) {
+            endwin();
+            fprintf(stderr, "The scrollback size is in KB and must be positive\n");
+            exit(-1);
+        }
+        if (scrollback_kb > SCROLLBACK_MAX_KB)
+            scrollback_kb = SCROLLBACK_MAX_KB;
+        scrollback_init((size_t) scrollback_kb * 1024);
+        
+        /* Without a room we join the lobby shared by every server */
+        if (argc == 5)
+            room_name = argv[4];
+        
+        /* A dropped connection is detected by the receive thread, not by SIGPIPE */
+        signal(SIGPIPE, SIG_IGN);
+        srandom(time(NULL) ^ getpid());
+        
+        /* Attachments are the biggest frames the server sends */
+        transport_max_frame = transport_max_stream = MAX_ATTACHMENT_SIZE;
+        
         /* Init network connection */
-        int sock_fd;
-        sock_fd = connect_client(argv[1], argv[2]);
+        server_host = argv[1];
+        server_port = argv[2];
+        if ((sock_fd = transport_connect(server_host, server_port)) == -1) {
+            endwin();
+            perror("connect");
+            exit(-1);
+        }
+        
+        write_in_chat_window("[info] Connected\n");
         
         /* Send username to server */
         write_in_input_window("Enter username: ");
         username = (char *) malloc(32);
         wgetnstr(input_window, username, 32);
-        send_message(sock_fd, username);
+        send_handshake(sock_fd);
+        connected = 1;
         
         /* Clear input window */
         clear_window(input_window);
         
-        /* Create I/O threads */
-        pthread_t send_thread, receive_thread;
+        /* Create I/O and render threads */
+        pthread_t send_thread, receive_thread, render_thread;
         pthread_attr_t joinable_attr;
         pthread_attr_init(&joinable_attr);
         pthread_attr_setdetachstate(&joinable_attr, PTHREAD_CREATE_JOINABLE);
         
-        int *sock_fd_ptr = &sock_fd;
-        pthread_create(&send_thread, &joinable_attr, send_thread_loop, (void *) sock_fd_ptr);
-        pthread_create(&receive_thread, &joinable_attr, receive_thread_loop, (void *) sock_fd_ptr);
+        pthread_create(&send_thread, &joinable_attr, send_thread_loop, NULL);
+        pthread_create(&receive_thread, &joinable_attr, receive_thread_loop, NULL);
+        pthread_create(&render_thread, NULL, render_thread_loop, NULL);
         
         pthread_join(send_thread, NULL);
         pthread_join(receive_thread, NULL);
@@ -13,6 +13,7 @@
 #include <unistd.h>
 
 #include <pthread.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -23,10 +24,19 @@
 #include <termios.h>
 #include <curses.h>
 
-#define LEN_FIELD_SIZE 4
+#include "ptmp_transport.h"
+
+/* Incoming lines are drawn in batches, at most this many times per second */
+#define RENDER_FPS 30
+
+/* The server streams frames of up to this size to the room */
+#define MAX_FRAME_SIZE (64 * 1024 * 1024)
+
+typedef struct _render_line_t {
+    char *text;
+    struct _render_line_t *next;
+} render_line_t;
 
-char *process_message(int sock_fd);
-void send_message(int sock_fd, const char *buf);
 void write_in_window(WINDOW *win, int *current_line, int window_height, const char *message, ...);
 
 /* UI stuff */
@@ -34,118 +44,31 @@ WINDOW *chat_window;
 WINDOW *input_window;
 
 int chat_height, input_height;
+int chat_width;
 int current_chat_line, current_input_line;
 
 /* Inter-thread communication variables */
 pthread_mutex_t draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/* Lines waiting for the next frame */
+pthread_mutex_t render_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t render_cond = PTHREAD_COND_INITIALIZER;
+render_line_t *render_head = NULL, *render_tail = NULL;
+
 char *username;
 
 #define write_in_chat_window(m, ...) write_in_window(chat_window, &current_chat_line, chat_height, m, ##__VA_ARGS__)
 #define write_in_input_window(m, ...) write_in_window(input_window, &current_input_line, input_height, m, ##__VA_ARGS__)
 
-void pack_32i(uint32_t value, char *buffer) {
-    *buffer = value >> 24;
-    *(buffer + 1) = value >> 16;
-    *(buffer + 2) = value >> 8;
-    *(buffer + 3) = value;
-}
-
-uint32_t unpack_32i(char *buffer) {
-    return (*(buffer + 3)) | (*(buffer + 2) << 8) | (*(buffer + 1) << 16) | (*buffer << 24);
-}
-
-void send_message(int sock_fd, const char *data) {
-    char *msg = NULL;
-    
-    /* Compute lengths, account for NUL in data_len */
-    uint32_t data_len = strlen(data) + 1;
-    uint32_t msg_len = data_len + LEN_FIELD_SIZE;
-    
-    /* Allocate msg buffer and set the length */
-    msg = (char *) malloc(msg_len);
-    pack_32i(msg_len, msg);
-    
-    /* Copy data to msg buffer */
-    memcpy(msg + LEN_FIELD_SIZE, data, data_len);
-    
-    /* Write data to wire */
-    int bytes_written = 0, bytes_left = msg_len - bytes_written, total = 0;
-    while (bytes_left > 0) {
-        bytes_written = send(sock_fd, msg + total, bytes_left, 0);
-        bytes_left -= bytes_written;
-        total += bytes_left;
-    }
-}
-
-char *process_message(int sock_fd) {
-    /* Message structure:
-     * <length> <data>
-     * Length includes all of the other fields and itself. It is a 32-bit integer.
-     * Data is the data. Ignored if type == 1.
-     */
-    
-    /* Working buffer */
-    char *sock_buf = (char *) malloc(1024);
-    
-    /* Another buffer we'll use later for the data field */
-    char *data_buf;
-    
-    /* Start by receiving LEN_FIELD_SIZE bytes to get the next message length */
-    memset(sock_buf, 0, 1024);
-    if (recv(sock_fd, sock_buf, LEN_FIELD_SIZE, 0) == 0) {
-        write_in_chat_window("[info] Connection closed\n");
-        exit(0);
-    }
-    
-    /* Unpack length */
-    uint32_t msg_len = unpack_32i(sock_buf);
-    uint32_t data_len = msg_len - LEN_FIELD_SIZE; /* Substract 4 bytes to get the data length */
-    
-    /* Allocate another buffer for the message, take NUL into account */
-    data_buf = (char *) malloc(data_len + 1);
-    /* Various counters */
-    int bytes_read = 0, bytes_left = data_len - bytes_read, total = 0;
-    
-    while (bytes_left > 0) {
-        bytes_read = recv(sock_fd, sock_buf, 1024, 0);
-        
-        memcpy(data_buf + total, sock_buf, bytes_read);
-        
-        bytes_left -= bytes_read;
-        total += bytes_read;
-    }
-    
-    /* Add NUL-terminator */
-    data_buf[total] = '\0';
-    
-    /* Free socket buffer */
-    free(sock_buf);
-    
-    return data_buf;
-}
-
 int connect_client(const char *host, const char *port) {
-    int sock_fd;
-    struct addrinfo hints, *result;
-    
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    
-    getaddrinfo(host, port, &hints, &result);
-    
-    sock_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (connect(sock_fd, result->ai_addr, result->ai_addrlen) == -1) {
+    int sock_fd = transport_connect(host, port);
+    if (sock_fd == -1) {
         perror("connect");
         exit(-1);
     }
     
     write_in_chat_window("[info] Connected\n");
     
-    freeaddrinfo(result);
-    
     return sock_fd;
 }
 
@@ -170,11 +93,111 @@ void clear_window(WINDOW *win) {
     wrefresh(win);
 }
 
+void sleep_ms(long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000;
+    nanosleep(&ts, NULL);
+}
+
+void queue_chat_line(const char *format, ...) {
+    /* Format the line and leave it for the render thread */
+    render_line_t *line = (render_line_t *) malloc(sizeof(render_line_t));
+    va_list args;
+    va_start(args, format);
+    vasprintf(&line->text, format, args);
+    va_end(args);
+    line->next = NULL;
+    
+    pthread_mutex_lock(&render_mutex);
+    if (render_tail)
+        render_tail->next = line;
+    else
+        render_head = line;
+    render_tail = line;
+    
+    pthread_cond_signal(&render_cond);
+    pthread_mutex_unlock(&render_mutex);
+}
+
+int line_rows(const char *text, int width) {
+    /* Number of window rows a line wraps to */
+    int len = strlen(text);
+    return len == 0 ? 1 : (len + width - 1) / width;
+}
+
+void draw_chat_lines(render_line_t *lines) {
+    /* Draw a batch into the chat window without refreshing it. Called with draw_mutex held */
+    int width = chat_width - 2, visible_rows = chat_height - 2;
+    int total_rows = 0;
+    render_line_t *line;
+    
+    for (line = lines; line; line = line->next)
+        total_rows += line_rows(line->text, width);
+    
+    /* Rows that would scroll out of view before the frame is shown are never drawn */
+    int skip_rows = total_rows > visible_rows ? total_rows - visible_rows : 0;
+    
+    for (line = lines; line; line = line->next) {
+        int rows = line_rows(line->text, width), row;
+        
+        for (row = 0; row < rows; row++, skip_rows--) {
+            if (skip_rows > 0)
+                continue;
+            
+            if (current_chat_line > chat_height - 2) {
+                scroll(chat_window);
+                current_chat_line = chat_height - 2;
+            }
+            
+            mvwaddnstr(chat_window, current_chat_line, 1, line->text + row * width, width);
+            current_chat_line++;
+        }
+    }
+}
+
+void *render_thread_loop(void *unused) {
+    /* Wait for queued lines;
+     * Take the whole batch;
+     * Acquire draw mutex, draw, push one update to the terminal, release;
+     * Sleep out the rest of the frame
+     */
+    while (1) {
+        pthread_mutex_lock(&render_mutex);
+        while (render_head == NULL)
+            pthread_cond_wait(&render_cond, &render_mutex);
+        
+        render_line_t *batch = render_head;
+        render_head = render_tail = NULL;
+        pthread_mutex_unlock(&render_mutex);
+        
+        pthread_mutex_lock(&draw_mutex);
+        draw_chat_lines(batch);
+        
+        /* Input window last, so the cursor stays where the user is typing */
+        wnoutrefresh(chat_window);
+        wnoutrefresh(input_window);
+        doupdate();
+        pthread_mutex_unlock(&draw_mutex);
+        
+        while (batch) {
+            render_line_t *next = batch->next;
+            free(batch->text);
+            free(batch);
+            batch = next;
+        }
+        
+        /* Cap the frame rate; whatever arrives meanwhile goes into the next batch */
+        sleep_ms(1000 / RENDER_FPS);
+    }
+}
+
 void *send_thread_loop(void *sock_fd_ptr) {
     /* Wait for user input;
      * Assemble message;
      * Send;
-     * Acquire draw mutex, draw, release
+     * Queue the line for the render thread;
+     * Acquire draw mutex, clear input, release
      * Repeat
      */
     char *input_buffer = (char *) malloc(1024);
@@ -189,8 +212,9 @@ void *send_thread_loop(void *sock_fd_ptr) {
         
         send_message(sock_fd, formatted_data);
         
+        queue_chat_line("%s", formatted_data);
+        
         pthread_mutex_lock(&draw_mutex);
-        write_in_chat_window(formatted_data);
         clear_window(input_window);
         pthread_mutex_unlock(&draw_mutex);
     }
@@ -201,17 +225,38 @@ void *send_thread_loop(void *sock_fd_ptr) {
 
 void *receive_thread_loop(void *sock_fd_ptr) {
     /* process_message
-     * Acquire draw mutex, draw, release
+     * Queue the line for the render thread
      * Repeat
      */
     int sock_fd = *((int *) sock_fd_ptr);
     
     while (1) {
         char *rcvd_msg = process_message(sock_fd);
+        if (rcvd_msg == NULL) {
+            write_in_chat_window("[info] Connection closed\n");
+            exit(0);
+        }
         
-        pthread_mutex_lock(&draw_mutex);
-        write_in_chat_window(rcvd_msg);
-        pthread_mutex_unlock(&draw_mutex);
+        /* Frames starting with 0x7F are for the server's own clients: presence,
+         * offers of batch and multicast frames, its boot id. None of them is text.
+         * An attachment's body is the frame after it, and is dropped too */
+        if (rcvd_msg[0] == '\x7f') {
+            if (rcvd_msg[1] == 'A' && strchr(rcvd_msg, ':') != NULL) {
+                char *body = process_frame(sock_fd, NULL);
+                if (body == NULL) {
+                    write_in_chat_window("[info] Connection closed\n");
+                    exit(0);
+                }
+                
+                queue_chat_line("[info] Someone shared %s, which this client can't save", strchr(rcvd_msg, ':') + 1);
+                free(body);
+            }
+            
+            free(rcvd_msg);
+            continue;
+        }
+        
+        queue_chat_line("%s", rcvd_msg);
         
         free(rcvd_msg);
     }
@@ -274,6 +319,7 @@ int main(int argc, const char * argv[]) {
     /* Set top and bottom window sizes */
     chat_height = max_y * (8.0f/10.0f);
     input_height = max_y * (2.0f/10.0f);
+    chat_width = max_x;
     
     chat_window = newwin(chat_height, max_x, 0, 0);
     input_window = newwin(input_height, max_x, chat_height, 0);
@@ -297,6 +343,8 @@ int main(int argc, const char * argv[]) {
     wrefresh(chat_window);
     wrefresh(input_window);
     
+    transport_max_frame = transport_max_stream = MAX_FRAME_SIZE;
+    
     if (argc >= 3) {
         if (strcmp(argv[1], "-b") == 0) {
             /* Broadcast server lookup message */
@@ -315,8 +363,8 @@ int main(int argc, const char * argv[]) {
             /* Clear input window */
             clear_window(input_window);
             
-            /* Create I/O threads */
-            pthread_t send_thread, receive_thread;
+            /* Create I/O and render threads */
+            pthread_t send_thread, receive_thread, render_thread;
             pthread_attr_t joinable_attr;
             pthread_attr_init(&joinable_attr);
             pthread_attr_setdetachstate(&joinable_attr, PTHREAD_CREATE_JOINABLE);
@@ -324,6 +372,7 @@ int main(int argc, const char * argv[]) {
             int *sock_fd_ptr = &sock_fd;
             pthread_create(&send_thread, &joinable_attr, send_thread_loop, (void *) sock_fd_ptr);
             pthread_create(&receive_thread, &joinable_attr, receive_thread_loop, (void *) sock_fd_ptr);
+            pthread_create(&render_thread, NULL, render_thread_loop, NULL);
             
             pthread_join(send_thread, NULL);
             pthread_join(receive_thread, NULL);
@@ -0,0 +1,189 @@
+//
+//  main.c
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include <termios.h>
+#include <curses.h>
+
+#include "ptmp_transport.h"
+
+/* Handlers run on the select loop unless CHAT_BACKEND says otherwise. The threaded
+ * server is this one built with -DDEFAULT_BACKEND='"threads"' */
+#ifndef DEFAULT_BACKEND
+#define DEFAULT_BACKEND "select"
+#endif
+
+#define MAX_CLIENTS 32
+
+void start_server_loop(const char *port);
+void on_open(transport_conn_t *conn);
+void on_frame(transport_conn_t *conn, char *frame, uint32_t frame_len);
+void on_close(transport_conn_t *conn);
+
+void write_in_window(const char *message, ...);
+void clear_window();
+
+/* Current window line */
+int current_line, window_height, window_width;
+
+/* Inter-thread communication variables */
+pthread_mutex_t draw_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Connections that have sent their username. Each one's data is the username */
+transport_conn_t *clients[MAX_CLIENTS];
+int clients_counter = 0;
+
+transport_handlers_t handlers = { on_open, on_frame, on_close };
+
+void start_server_loop(const char *port) {
+    /* CHAT_BACKEND picks another backend than this server's own */
+    const char *backend_name = getenv("CHAT_BACKEND") ? getenv("CHAT_BACKEND") : DEFAULT_BACKEND;
+    int backend = transport_backend(backend_name);
+    if (backend == -1) {
+        endwin();
+        fprintf(stderr, "Unknown backend %s\n", backend_name);
+        exit(-1);
+    }
+    
+    int listen_fd;
+    if ((listen_fd = transport_listen(port)) == -1) {
+        endwin();
+        perror("listen");
+        exit(-1);
+    }
+    
+    write_in_window("[info] Started listening (%s)", transport_backend_name(backend));
+    
+    if (transport_serve(listen_fd, backend, &handlers) == -1) {
+        endwin();
+        perror(transport_backend_name(backend));
+        exit(1);
+    }
+    
+    /* Close listening socket */
+    close(listen_fd);
+}
+
+void on_open(transport_conn_t *conn) {
+    /* The username comes as the first frame */
+    pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Received connection");
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+void on_frame(transport_conn_t *conn, char *frame, uint32_t frame_len) {
+    int i;
+    
+    if (conn->data == NULL) {
+        /* Lock client list and add the new client */
+        pthread_mutex_lock(&client_list_mutex);
+            if ((clients_counter + 1) == MAX_CLIENTS) {
+                /* Max amount of clients reached */
+                transport_send_message(conn, "Too many clients!");
+                transport_close(conn);
+            } else {
+                conn->data = strdup(frame);
+                clients[clients_counter++] = conn;
+            }
+        pthread_mutex_unlock(&client_list_mutex);
+        return;
+    }
+    
+    /* Transmit the message on all other connections. With the select and epoll
+     * backends a slow client's share is queued on its connection; with the threads
+     * backend transport_send blocks until the client takes it, and holds up the
+     * others meanwhile */
+    pthread_mutex_lock(&client_list_mutex);
+        for (i = 0; i < clients_counter; i++)
+            if (clients[i] != conn)
+                transport_send(clients[i], frame, frame_len);
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    /* Print the message on the server */
+    pthread_mutex_lock(&draw_mutex);
+        write_in_window("%s", frame);
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+void on_close(transport_conn_t *conn) {
+    int i;
+    
+    /* Take the client off the list before the connection goes away */
+    pthread_mutex_lock(&client_list_mutex);
+        for (i = 0; i < clients_counter; i++) {
+            if (clients[i] == conn) {
+                clients[i] = clients[--clients_counter];
+                break;
+            }
+        }
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    free(conn->data);
+    
+    pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Connection closed");
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+void write_in_window(const char *message, ...) {
+    va_list args;
+    va_start(args, message);
+    move(current_line, 1);
+    vwprintw(stdscr, message, args);
+    va_end(args);
+    
+    if (current_line != window_height)
+        current_line++;
+    else
+        scroll(stdscr);
+    
+    wrefresh(stdscr);
+}
+
+void clear_window(WINDOW *win) {
+    werase(win);
+    box(win, '|', '=');
+    wrefresh(win);
+}
+
+int main(int argc, const char * argv[]) {
+    /* Init ncurses */
+    initscr();
+    
+    /* Retrieve dimensions */
+    getmaxyx(stdscr, window_height, window_width);
+    
+    /* Current line is 1 */
+    current_line = 1;
+    
+    /* Enable scrolling on the window */
+    scrollok(stdscr, TRUE);
+    
+    /* Specify the scrolling region in the window, taking borders into account */
+    wsetscrreg(stdscr, 1, window_height - 2);
+    
+    /* Erase window and draw the borders */
+    clear_window(stdscr);
+    
+    /* Draw the windows */
+    wrefresh(stdscr);
+    
+    /* Start listen loop */
+    start_server_loop(argv[1]);
+    
+    endwin();
+    return 0;
+}
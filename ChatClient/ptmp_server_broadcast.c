@@ -8,58 +8,464 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <errno.h>
+#include <ctype.h>
 #include <unistd.h>
 
 #include <pthread.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#endif
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <termios.h>
 #include <curses.h>
 
-#define LEN_FIELD_SIZE 4
+#include "ptmp_transport.h"
+
 #define MAX_CLIENTS 32
+#define HISTORY_SIZE 256
+
+/* Fanout loops only walk the dense client_hot table; usernames and rooms are
+ * interned so they compare as small ids. INTERN_SIZE covers two strings per
+ * client and per history entry */
+#define CLIENT_ACTIVE 1
+#define CLIENT_PEER 2
+#define CLIENT_LISTED 4
+#define CLIENT_MULTICAST 8
+#define INTERN_SIZE 1024
+#define INTERN_BUCKETS 256
+
+/* Frames up to MAX_FRAME_SIZE are read whole. Bigger ones, up to MAX_STREAM_SIZE,
+ * are forwarded in STREAM_CHUNK_SIZE pieces as they arrive. Past STREAM_TIMEOUT
+ * seconds of grace, they must keep up STREAM_MIN_RATE bytes a second */
+#define MAX_FRAME_SIZE (64 * 1024)
+#define MAX_STREAM_SIZE (64 * 1024 * 1024)
+#define STREAM_CHUNK_SIZE (16 * 1024)
+#define STREAM_TIMEOUT 5
+#define STREAM_MIN_RATE (256 * 1024)
+
+/* A hot restart waits this long, in seconds, for streams and attachments to end;
+ * clients still busy with one then are left behind */
+#define RESTART_TIMEOUT 10
+
+/* Frame buffers come from per-thread free lists in power-of-two size classes
+ * (64 bytes to 128 KB), which trade batches of POOL_BATCH blocks with a shared depot */
+#define POOL_CLASSES 12
+#define POOL_MIN_BLOCK 64
+#define POOL_HEADER_SIZE 16
+#define POOL_BATCH 32
+#define POOL_CACHE_MAX (2 * POOL_BATCH)
+
+/* File attachments: a control frame 0x7F 'A' <size>:<name>, then one frame
+ * holding the file, which is spliced from socket to sockets */
+#define MAX_ATTACHMENT_SIZE (256 * 1024 * 1024)
+#define ATTACHMENT_CHUNK_SIZE (256 * 1024)
+
+/* Joins and leaves are collected for PRESENCE_BATCH_MS, then each room's clients get
+ * one 0x7F 'U' <from version>:<to version> frame with a "\n+name" or "\n-name" line
+ * per change. Newcomers instead get one 0x7F 'S' <version> frame listing everyone.
+ * CLIENT_LISTED marks the clients the others already know about */
+#define PRESENCE_BATCH_MS 200
+
+/* Messages from local clients are matched against the banned terms in the file
+ * named by $CHAT_FILTER, which is recompiled when it changes */
+#define FILTER_CHECK_MS 1000
+
+/* Federation: message ids are <origin node, per-node counter>, and each node
+ * remembers the last DEDUPE_WINDOW ids of up to MAX_NODES origins */
+#define MAX_NODES 64
+#define DEDUPE_WINDOW 4096
+#define PEER_RETRY_DELAY 1
+
+/* Cluster membership: SWIM-style gossip over the discovery UDP port */
+#define PROTOCOL_PERIOD_MS 1000
+#define PING_TIMEOUT_MS 300
+#define INDIRECT_PROBES 3
+#define SUSPECT_TIMEOUT_MS 3000
+#define DEAD_REAP_MS 30000
+#define GOSSIP_RETRANSMITS 4
+#define GOSSIP_HEADER_SIZE 30
+#define GOSSIP_UPDATE_SIZE 17
+#define GOSSIP_MAX_UPDATES 32
+#define GOSSIP_MAX_RELAYS 16
+#define GOSSIP_RELAY_SEQ_BASE 0x80000000
+
+#define MEMBER_ALIVE 0
+#define MEMBER_SUSPECT 1
+#define MEMBER_DEAD 2
+
+/* Room placement: each node owns the rooms that hash next to one of its
+ * RING_VNODES points on the ring. The lobby (no room) is shared by all nodes */
+#define RING_VNODES 64
+
+/* Nodes on the same host read each other's relayed messages straight out of a
+ * shared memory ring instead of over loopback TCP */
+#define RING_SIZE (4 * 1024 * 1024)
+#define RING_MAX_CONSUMERS 16
+#define RING_PADDING 0xffffffff
+
+/* Each connection has a writer thread draining three lanes. Control frames
+ * (presence, notices, redirects) always go first; private messages and room chat
+ * then share the socket, LANE_DIRECT_WEIGHT of the former for one of the latter.
+ * Room chat stays in sequence order, replays included. A connection whose
+ * backlog passes MAX_QUEUED_BYTES, or that takes no data for SEND_TIMEOUT
+ * seconds, is cut off */
+#define LANE_CONTROL 0
+#define LANE_DIRECT 1
+#define LANE_CHAT 2
+#define LANE_COUNT 3
+#define LANE_DIRECT_WEIGHT 4
+#define MAX_QUEUED_BYTES (8 * 1024 * 1024)
+#define SEND_TIMEOUT 5
+
+/* Batch frames: clients are offered an empty 0x7F 'B'. Once one answers with its
+ * own, the room chat that piled up for it while its writer was busy goes out as a
+ * single 0x7F 'B' frame, each message in it as <16-bit length><data>, up to
+ * BATCH_MAX_SIZE bytes of them */
+#define BATCH_MAX_SIZE (64 * 1024)
+
+/* Local connections: with $CHAT_LOCAL_SOCKET set to a path, bots and sidecars on
+ * this host can connect there with AF_UNIX SOCK_SEQPACKET. Every frame is one
+ * packet, without the length field, and at most MAX_FRAME_SIZE long; there are
+ * no streams or attachments */
+
+/* Pipeline tracing: with $CHAT_TRACE set to N, one message in N is timed as it is
+ * received, handed to the transmit thread, fanned out, and queued and written for
+ * each recipient. Each thread appends to its own buffer of the last TRACE_EVENTS
+ * events; SIGUSR1 dumps them all as Chrome trace JSON */
+#define TRACE_EVENTS 4096
+#define TRACE_RECV 0
+#define TRACE_HANDOFF 1
+#define TRACE_FANOUT 2
+#define TRACE_QUEUED 3
+#define TRACE_WRITE 4
+
+/* Low-latency mode: $CHAT_CPUS lists up to MAX_PINNED_CPUS cores, like "2,4-7".
+ * The transmit thread is pinned to the first; each connection's threads go to the
+ * core its packets arrive on if that is one of the others, or else to the next of
+ * them in turn. With $CHAT_BUSY_POLL set to N, sockets and idle threads spin for
+ * N microseconds before they sleep */
+#define MAX_PINNED_CPUS 64
+
+/* Multicast fanout: with $CHAT_MULTICAST set to <group>:<port>, room chat goes out
+ * once per message as a datagram to the room's group, the room's hash picking one
+ * of MULTICAST_GROUPS addresses from <group> on; $CHAT_MULTICAST_IF is the address
+ * of the interface to send from. Clients get 0x7F 'M' <group>:<port> and answer
+ * 0x7F 'J' once they've joined; the reply, 0x7F 'J' <node id>:<room seq>, is the
+ * last room message they get over TCP. A datagram is
+ *   <node id><room seq><username>\0<room>\0<data>\0<seq>\0
+ * with both ids as 32-bit integers, room seq counting the room's messages. A
+ * client missing some asks with 0x7F 'N' <first>-<last> and gets them from the
+ * history, then 0x7F 'N' <last>. Every MULTICAST_HEARTBEAT_MS each room with
+ * listeners sends its last room seq without a username or data, so a lost last
+ * message shows up too. Messages longer than MULTICAST_MAX_DATAGRAM only go out
+ * that way */
+#define MULTICAST_GROUPS 256
+#define MULTICAST_HEARTBEAT_MS 1000
+#define MULTICAST_MAX_DATAGRAM 1400
+
+typedef struct _queued_frame_t {
+    struct _queued_frame_t *next;
+    uint32_t len;
+    uint32_t trace_id;
+    long long queued_us;
+    char data[];
+} queued_frame_t;
+
+typedef struct _lane_t {
+    queued_frame_t *head;
+    queued_frame_t *tail;
+} lane_t;
+
+typedef struct _client_queue_t {
+    lane_t lanes[LANE_COUNT];
+    uint32_t queued_bytes;
+    pthread_cond_t cond;
+} client_queue_t;
 
 typedef struct _thread_data_t {
     int client_id;
+    uint32_t peer_node_id;
     int sock_fd;
-    char *username;
+    uint16_t username;
     char *transmit_buffer;
+    uint32_t transmit_len;
+    uint32_t trace_id;
+    long long handoff_us;
+    uint32_t generation;
+    int close_when_drained;
+    int cpu;
+    char header[LEN_FIELD_SIZE];
+    int header_len;
+    uint32_t body_len;
+    uint32_t body_size;
+    int in_body;
+    int parked;
+    int batching;
+    int packet;
+    pthread_t writer;
+    pthread_mutex_t write_mutex;
 } thread_data_t;
 
+typedef struct _client_hot_t {
+    int sock_fd;
+    uint16_t room;
+    uint16_t flags;
+    client_queue_t *queue;
+} client_hot_t;
+
+typedef struct _interned_t {
+    char *string;
+    uint32_t hash;
+    int refs;
+    int next;
+    int client;
+    uint32_t version;
+    uint32_t multicast_seq;
+} interned_t;
+
+typedef struct _trace_event_t {
+    long long start_us;
+    uint32_t dur_us;
+    uint32_t trace_id;
+    uint32_t stage;
+    uint32_t arg;
+} trace_event_t;
+
+typedef struct _trace_buffer_t {
+    struct _trace_buffer_t *next;
+    int tid;
+    int retired;
+    uint32_t head;
+    trace_event_t events[TRACE_EVENTS];
+} trace_buffer_t;
+
+typedef struct _pool_block_t {
+    struct _pool_block_t *next;
+    struct _pool_block_t *next_batch;
+    int count;
+} pool_block_t;
+
+typedef struct _pool_cache_t {
+    pool_block_t *head[POOL_CLASSES];
+    int count[POOL_CLASSES];
+} pool_cache_t;
+
 typedef struct _broadcast_data_t {
-    char *port;
-    char *room_name;
+    const char *port;
+    const char *room_name;
+    const char **peers;
+    int peer_count;
 } broadcast_data_t;
 
-char *process_message(int sock_fd);
-void send_message(int sock_fd, const char *buf);
+typedef struct _filter_t {
+    int pattern_count;
+    int state_count;
+    int class_count;
+    uint8_t classes[256];
+    int32_t *delta;
+    char **patterns;
+    uint32_t *hits;
+} filter_t;
 
-void start_server_loop(const char *port, const char *room_name);
+typedef struct _presence_leave_t {
+    uint16_t username;
+    uint16_t room;
+} presence_leave_t;
+
+typedef struct _history_entry_t {
+    uint32_t seq;
+    uint32_t multicast_seq;
+    uint16_t username;
+    uint16_t room;
+    char *data;
+} history_entry_t;
+
+typedef struct _dedupe_window_t {
+    uint32_t node_id;
+    uint32_t max_seq;
+    uint64_t seen[DEDUPE_WINDOW / 64];
+} dedupe_window_t;
+
+typedef struct _member_t {
+    uint32_t node_id;
+    struct sockaddr_in address;
+    uint32_t incarnation;
+    int state;
+    uint16_t load;
+    long long state_changed_ms;
+    int gossip_left;
+    int linked;
+    int ring_attached;
+} member_t;
+
+typedef struct _peer_link_t {
+    char *host;
+    char *port;
+    uint32_t node_id;
+} peer_link_t;
+
+typedef struct _gossip_relay_t {
+    uint32_t seq;
+    uint32_t target;
+    struct sockaddr_in requester;
+    uint32_t requester_seq;
+} gossip_relay_t;
+
+typedef struct _ring_point_t {
+    uint32_t hash;
+    uint32_t node_id;
+    struct sockaddr_in address;
+} ring_point_t;
+
+typedef struct _ring_consumer_t {
+    uint64_t read_pos;
+    uint32_t node_id;
+    uint32_t sleeping;
+    int active;
+} ring_consumer_t;
+
+typedef struct _shm_ring_t {
+    uint64_t write_pos;
+    uint32_t node_id;
+    ring_consumer_t consumers[RING_MAX_CONSUMERS];
+    char data[RING_SIZE];
+} shm_ring_t;
+
+typedef struct _ring_record_t {
+    uint32_t len;
+    uint32_t sender;
+    char data[];
+} ring_record_t;
+
+void queue_sequenced_message(int id, const char *data, uint32_t seq);
+void replay_history(int id, uint16_t username, uint16_t room, uint32_t resume_seq);
+void multicast_group(uint16_t room, struct sockaddr_in *group);
+void *writer_thread(void *arg);
+uint32_t hash_bytes(const void *data, size_t len, uint32_t hash);
+void *peer_connector_thread(void *arg);
+member_t *find_member(uint32_t id);
+void attach_member_ring(member_t *member);
+void relay_transmit_buffer(thread_data_t *data);
+long long now_us(void);
+uint32_t trace_sample(void);
+void trace_record(uint32_t trace_id, int stage, long long start_us, uint32_t arg);
+void trace_release(void);
+void pin_thread(pthread_t thread, int cpu);
+int connection_cpu(int sock_fd);
+void cpu_relax(void);
+int recv_client_header(thread_data_t *data, uint32_t *data_len);
+int recv_client_body(thread_data_t *data, uint32_t data_len);
+void lock_writers(int *slots, int count, int lock);
+
+void start_server_loop(const char *port, const char *room_name, const char **peers, int peer_count);
 pthread_t spawn_client_thread(thread_data_t *thread_data);
 void *client_thread_loop(void *sock_fd_ptr);
 void *transmit_thread(void *unused);
+void *presence_thread(void *unused);
 
 void write_in_window(const char *message, ...);
 void clear_window();
 
-/* Client threads */
+/* Client threads. client_hot holds what the fanout loops read, including where
+ * each client's queue is, client_data the rest */
 pthread_t client_threads[MAX_CLIENTS];
+client_hot_t client_hot[MAX_CLIENTS];
+client_queue_t client_queues[MAX_CLIENTS];
 thread_data_t client_data[MAX_CLIENTS];
 int client_counter;
 
+/* Interned usernames and rooms; buckets and next hold id + 1 so that 0 ends a chain,
+ * client is the slot + 1 of the local client using a username, if any,
+ * version is a room's roster version and multicast_seq its last room seq.
+ * Guarded by client_list_mutex */
+interned_t interned[INTERN_SIZE];
+int intern_buckets[INTERN_BUCKETS];
+
+/* Listed clients that left since the last presence update; each holds a
+ * reference on its username and room. Guarded by client_list_mutex */
+presence_leave_t presence_leaves[MAX_CLIENTS];
+int presence_leave_count = 0, presence_dirty = 0;
+pthread_cond_t presence_cond = PTHREAD_COND_INITIALIZER;
+
+/* Recently relayed messages, so reconnecting clients can catch up. Sequence numbers
+ * start over with the server; boot_id tells clients which run numbered what they
+ * have seen, and survives a hot restart */
+history_entry_t history[HISTORY_SIZE];
+uint32_t last_seq = 0, boot_id;
+
+/* Federation state, only touched by the transmit thread */
+uint32_t node_id, last_message_id = 0;
+dedupe_window_t dedupe_windows[MAX_NODES];
+int dedupe_window_count = 0;
+
+/* Cluster membership, guarded by members_mutex. The probe and relay state
+ * belongs to the broadcast listener thread */
+member_t members[MAX_NODES];
+int member_count = 0;
+uint32_t incarnation = 0;
+uint16_t chat_port;
+int gossip_fd;
+uint32_t probe_target = 0, probe_seq = 0, relay_seq = 0;
+int probe_acked, probe_indirect_sent;
+long long probe_started_ms, next_probe_ms = 0;
+gossip_relay_t relays[GOSSIP_MAX_RELAYS];
+
+/* Hash ring over the live members, rebuilt by the broadcast listener */
+ring_point_t ring[(MAX_NODES + 1) * RING_VNODES];
+int ring_size = 0, ring_dirty = 1;
+
+/* Our outgoing shared ring; the descriptors of each consumer stay in this process.
+ * A slot is free once its socket is -1. ring_consumer_mutex keeps the listener from
+ * closing a slot's descriptors while the publisher uses them */
+shm_ring_t *local_ring;
+int local_ring_fd;
+int ring_event_fds[RING_MAX_CONSUMERS], ring_consumer_socks[RING_MAX_CONSUMERS];
+
+/* Content filter. The broadcast listener compiles a changed list into
+ * pending_filter; whichever thread screens text next swaps it in. The transmit
+ * thread screens messages, client threads streams and attachment names, all
+ * under filter_mutex. filter_stat is the version of the file last compiled, filter_failed_stat the
+ * last one that couldn't be read, which is retried but only reported once */
+const char *filter_path;
+struct stat filter_stat, filter_failed_stat;
+long long next_filter_check_ms = 0;
+filter_t *pending_filter, *active_filter;
+
 /* Current window line */
 int current_line, window_height, window_width;
 
 /* Inter-thread communication variables */
 pthread_mutex_t draw_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t members_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ring_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t ring_consumer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t filter_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t copy_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t copy_buffer_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t transmitted_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -67,87 +473,2727 @@ pthread_cond_t transmitted_cond = PTHREAD_COND_INITIALIZER;
 
 int copy_from = -1, transmitted_from = -1;
 
-void pack_32i(uint32_t value, char *buffer) {
-    *buffer = value >> 24;
-    *(buffer + 1) = value >> 16;
-    *(buffer + 2) = value >> 8;
-    *(buffer + 3) = value;
+/* Buffer pools: each thread's own lists, and batches shared between threads */
+__thread pool_cache_t pool_cache;
+pool_block_t *pool_depot[POOL_CLASSES];
+pthread_mutex_t pool_depot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Tracing. Only a buffer's thread writes to it; buffers of threads that exited
+ * are taken over by new ones, never freed. trace_current is the message the
+ * transmit thread is queueing */
+uint32_t trace_every = 0, trace_counter = 0;
+int trace_tids = 0;
+trace_buffer_t *trace_buffers;
+__thread trace_buffer_t *trace_buffer;
+__thread uint32_t trace_current;
+volatile sig_atomic_t trace_dump_requested = 0;
+
+/* Low-latency mode, set up by main. next_connection_cpu is guarded by client_list_mutex */
+int pinned_cpus[MAX_PINNED_CPUS], pinned_cpu_count = 0, next_connection_cpu = 0;
+long long busy_poll_us = 0;
+
+/* Multicast fanout, set up by start_server_loop if enabled */
+int multicast_fd = -1;
+struct sockaddr_in multicast_base;
+long long next_heartbeat_ms = 0;
+
+/* Hot restart. restarting stops the client threads before their next frame; they
+ * only take SIGUSR2, which wakes them up for it, while waiting with restart_wait_mask */
+volatile sig_atomic_t restarting = 0;
+int restart_listen_fd = -1;
+#ifdef __linux__
+sigset_t restart_wait_mask;
+#endif
+
+int pool_class(uint32_t size) {
+    /* Smallest class whose blocks hold size bytes after the header, or -1 */
+    int size_class;
+    for (size_class = 0; size_class < POOL_CLASSES; size_class++)
+        if ((POOL_MIN_BLOCK << size_class) - POOL_HEADER_SIZE >= size)
+            return size_class;
+    
+    return -1;
+}
+
+void pool_refill(int size_class) {
+    /* Take a batch from the depot, or carve a new one out of a single malloc */
+    pthread_mutex_lock(&pool_depot_mutex);
+    pool_block_t *batch = pool_depot[size_class];
+    if (batch)
+        pool_depot[size_class] = batch->next_batch;
+    pthread_mutex_unlock(&pool_depot_mutex);
+    
+    if (batch == NULL) {
+        uint32_t block_size = POOL_MIN_BLOCK << size_class;
+        char *slab = (char *) malloc(block_size * POOL_BATCH);
+        int i;
+        
+        /* Nobody checks what pool_alloc returns */
+        if (slab == NULL) {
+            perror("malloc");
+            exit(-1);
+        }
+        
+        for (i = 0; i < POOL_BATCH; i++)
+            ((pool_block_t *) (slab + i * block_size))->next = i + 1 < POOL_BATCH ? (pool_block_t *) (slab + (i + 1) * block_size) : NULL;
+        
+        batch = (pool_block_t *) slab;
+        batch->count = POOL_BATCH;
+    }
+    
+    pool_cache.head[size_class] = batch;
+    pool_cache.count[size_class] = batch->count;
+}
+
+void pool_give_back(int size_class, int count) {
+    /* Move count blocks from this thread's list to the depot as one batch */
+    pool_block_t *batch = pool_cache.head[size_class], *last = batch;
+    int i;
+    
+    for (i = 1; i < count; i++)
+        last = last->next;
+    
+    pool_cache.head[size_class] = last->next;
+    pool_cache.count[size_class] -= count;
+    last->next = NULL;
+    batch->count = count;
+    
+    pthread_mutex_lock(&pool_depot_mutex);
+    batch->next_batch = pool_depot[size_class];
+    pool_depot[size_class] = batch;
+    pthread_mutex_unlock(&pool_depot_mutex);
+}
+
+void *pool_alloc(size_t size) {
+    /* Frame buffers come from this thread's free list for their size class;
+     * only sizes beyond the largest class go to malloc */
+    int size_class = pool_class(size);
+    char *block;
+    
+    if (size_class == -1) {
+        block = (char *) malloc(size + POOL_HEADER_SIZE);
+        size_class = POOL_CLASSES;
+        
+        if (block == NULL) {
+            perror("malloc");
+            exit(-1);
+        }
+    } else {
+        if (pool_cache.head[size_class] == NULL)
+            pool_refill(size_class);
+        
+        block = (char *) pool_cache.head[size_class];
+        pool_cache.head[size_class] = pool_cache.head[size_class]->next;
+        pool_cache.count[size_class]--;
+    }
+    
+    *(uint32_t *) block = size_class;
+    return block + POOL_HEADER_SIZE;
+}
+
+void pool_free(void *buffer) {
+    if (buffer == NULL)
+        return;
+    
+    char *block = (char *) buffer - POOL_HEADER_SIZE;
+    int size_class = *(uint32_t *) block;
+    
+    if (size_class == POOL_CLASSES) {
+        free(block);
+        return;
+    }
+    
+    ((pool_block_t *) block)->next = pool_cache.head[size_class];
+    pool_cache.head[size_class] = (pool_block_t *) block;
+    
+    /* Blocks freed by another thread than the one that allocated them pile up here */
+    if (++pool_cache.count[size_class] > POOL_CACHE_MAX)
+        pool_give_back(size_class, POOL_BATCH);
+}
+
+void pool_flush(void) {
+    /* Hand everything back before the thread exits */
+    int size_class;
+    for (size_class = 0; size_class < POOL_CLASSES; size_class++)
+        if (pool_cache.count[size_class] > 0)
+            pool_give_back(size_class, pool_cache.count[size_class]);
 }
 
-uint32_t unpack_32i(char *buffer) {
-    return (*(buffer + 3)) | (*(buffer + 2) << 8) | (*(buffer + 1) << 16) | (*buffer << 24);
+char *pool_strdup(const char *string) {
+    uint32_t len = strlen(string) + 1;
+    char *copy = (char *) pool_alloc(len);
+    
+    memcpy(copy, string, len);
+    return copy;
 }
 
-void send_message(int sock_fd, const char *data) {
-    char *msg = NULL;
+void queue_frame(int id, int lane, const char *data, uint32_t data_len) {
+    /* Hand a frame to the client's writer thread. Called with client_list_mutex held */
+    client_hot_t *hot = &client_hot[id];
+    client_queue_t *queue = hot->queue;
+    
+    if (queue->queued_bytes + data_len > MAX_QUEUED_BYTES) {
+        shutdown(hot->sock_fd, SHUT_RDWR);
+        return;
+    }
     
-    /* Compute lengths, account for NUL in data_len */
+    queued_frame_t *frame = (queued_frame_t *) pool_alloc(sizeof(queued_frame_t) + LEN_FIELD_SIZE + data_len);
+    frame->next = NULL;
+    frame->len = LEN_FIELD_SIZE + data_len;
+    frame->trace_id = trace_current;
+    frame->queued_us = trace_current ? now_us() : 0;
+    pack_32i(frame->len, frame->data);
+    memcpy(frame->data + LEN_FIELD_SIZE, data, data_len);
+    
+    if (queue->lanes[lane].tail)
+        queue->lanes[lane].tail->next = frame;
+    else
+        queue->lanes[lane].head = frame;
+    queue->lanes[lane].tail = frame;
+    queue->queued_bytes += frame->len;
+    
+    pthread_cond_signal(&queue->cond);
+}
+
+void queue_message(int id, int lane, const char *data) {
+    /* Account for NUL in the data length */
+    queue_frame(id, lane, data, strlen(data) + 1);
+}
+
+void queue_sequenced_message(int id, const char *data, uint32_t seq) {
+    /* The sequence number travels after the NUL of the data, so clients
+     * that don't know about it only see the plain string */
+    char seq_field[16];
     uint32_t data_len = strlen(data) + 1;
-    uint32_t msg_len = data_len + LEN_FIELD_SIZE;
+    uint32_t seq_len = snprintf(seq_field, sizeof(seq_field), "%u", seq) + 1;
+    
+    char *frame = (char *) pool_alloc(data_len + seq_len);
+    memcpy(frame, data, data_len);
+    memcpy(frame + data_len, seq_field, seq_len);
+    
+    queue_frame(id, LANE_CHAT, frame, data_len + seq_len);
+    
+    pool_free(frame);
+}
+
+void drop_queued_frames(client_queue_t *queue) {
+    /* Called with client_list_mutex held */
+    int lane;
+    
+    for (lane = 0; lane < LANE_COUNT; lane++)
+        while (queue->lanes[lane].head) {
+            queued_frame_t *frame = queue->lanes[lane].head;
+            queue->lanes[lane].head = frame->next;
+            pool_free(frame);
+        }
+    
+    for (lane = 0; lane < LANE_COUNT; lane++)
+        queue->lanes[lane].tail = NULL;
+    queue->queued_bytes = 0;
+}
+
+void *writer_thread(void *arg) {
+    /* Write one connection's queued frames until its slot is freed */
+    int id = ((uint32_t *) arg)[0], direct_sent = 0;
+    uint32_t generation = ((uint32_t *) arg)[1];
+    thread_data_t *client = &client_data[id];
+    client_queue_t *queue = client_hot[id].queue;
+    
+    free(arg);
+    
+    pthread_mutex_lock(&client_list_mutex);
+    int sock_fd = client->sock_fd;
+    
+    while (1) {
+        if (busy_poll_us && queue->queued_bytes == 0) {
+            pthread_mutex_unlock(&client_list_mutex);
+            long long until = now_us() + busy_poll_us;
+            while (__atomic_load_n(&queue->queued_bytes, __ATOMIC_RELAXED) == 0 && now_us() < until)
+                cpu_relax();
+            pthread_mutex_lock(&client_list_mutex);
+        }
+        
+        while (client->generation == generation && queue->queued_bytes == 0)
+            pthread_cond_wait(&queue->cond, &client_list_mutex);
+        
+        if (client->generation != generation)
+            break;
+        
+        /* Control first; then private messages, unless room chat has waited its turn */
+        int lane = LANE_CONTROL;
+        if (!queue->lanes[LANE_CONTROL].head) {
+            if (queue->lanes[LANE_DIRECT].head && (!queue->lanes[LANE_CHAT].head || direct_sent < LANE_DIRECT_WEIGHT)) {
+                lane = LANE_DIRECT;
+                direct_sent++;
+            } else {
+                lane = LANE_CHAT;
+                direct_sent = 0;
+            }
+        }
+        
+        queued_frame_t *frame = queue->lanes[lane].head, *last = frame;
+        uint32_t batch_len = 2 + frame->len - LEN_FIELD_SIZE, dequeued = frame->len;
+        int batched = 1;
+        
+        /* Take the rest of a chat burst along, if the client takes batches */
+        if (lane == LANE_CHAT && client->batching && frame->len - LEN_FIELD_SIZE <= UINT16_MAX)
+            while (last->next && last->next->len - LEN_FIELD_SIZE <= UINT16_MAX &&
+                   batch_len + 2 + last->next->len - LEN_FIELD_SIZE <= BATCH_MAX_SIZE) {
+                last = last->next;
+                batch_len += 2 + last->len - LEN_FIELD_SIZE;
+                dequeued += last->len;
+                batched++;
+            }
+        
+        queue->lanes[lane].head = last->next;
+        if (!last->next)
+            queue->lanes[lane].tail = NULL;
+        last->next = NULL;
+        queue->queued_bytes -= dequeued;
+        pthread_mutex_unlock(&client_list_mutex);
+        
+        queued_frame_t *queued;
+        long long write_us = 0;
+        for (queued = frame; queued; queued = queued->next)
+            if (queued->trace_id) {
+                trace_record(queued->trace_id, TRACE_QUEUED, queued->queued_us, id);
+                write_us = now_us();
+            }
+        
+        char *batch = NULL;
+        if (batched > 1) {
+            batch = (char *) pool_alloc(LEN_FIELD_SIZE + 2 + batch_len);
+            pack_32i(LEN_FIELD_SIZE + 2 + batch_len, batch);
+            batch[LEN_FIELD_SIZE] = '\x7f';
+            batch[LEN_FIELD_SIZE + 1] = 'B';
+            
+            char *field = batch + LEN_FIELD_SIZE + 2;
+            for (queued = frame; queued; queued = queued->next) {
+                pack_16i(queued->len - LEN_FIELD_SIZE, field);
+                memcpy(field + 2, queued->data + LEN_FIELD_SIZE, queued->len - LEN_FIELD_SIZE);
+                field += 2 + queued->len - LEN_FIELD_SIZE;
+            }
+        }
+        
+        char *out = batch ? batch : frame->data;
+        uint32_t out_len = batch ? LEN_FIELD_SIZE + 2 + batch_len : frame->len;
+        
+        /* Streams take the write lock for their whole frame */
+        pthread_mutex_lock(&client->write_mutex);
+        int result = client->packet ? send_packet(sock_fd, out + LEN_FIELD_SIZE, out_len - LEN_FIELD_SIZE) :
+                                      send_all(sock_fd, out, out_len);
+        pthread_mutex_unlock(&client->write_mutex);
+        
+        pool_free(batch);
+        while (frame) {
+            queued = frame->next;
+            trace_record(frame->trace_id, TRACE_WRITE, write_us, id);
+            pool_free(frame);
+            frame = queued;
+        }
+        
+        pthread_mutex_lock(&client_list_mutex);
+        
+        /* Let the client thread notice, and clean up */
+        if (result == -1 || (client->close_when_drained && queue->queued_bytes == 0 && client->generation == generation)) {
+            shutdown(sock_fd, SHUT_RDWR);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    pool_flush();
+    trace_release();
+    
+    return NULL;
+}
+
+int recv_client_header(thread_data_t *data, uint32_t *data_len) {
+    /* recv_frame_header for client threads, which a hot restart stops between frames.
+     * Returns 1 then, with whatever had arrived of the next header in data->header */
+    while (data->header_len < LEN_FIELD_SIZE) {
+        if (restarting)
+            return 1;
+        
+#ifdef __linux__
+        int bytes_read = recv(data->sock_fd, data->header + data->header_len, LEN_FIELD_SIZE - data->header_len, MSG_DONTWAIT);
+        if (bytes_read == -1 && errno == EAGAIN) {
+            struct pollfd pfd = { data->sock_fd, POLLIN, 0 };
+            ppoll(&pfd, 1, NULL, &restart_wait_mask);
+            continue;
+        }
+#else
+        int bytes_read = recv(data->sock_fd, data->header + data->header_len, LEN_FIELD_SIZE - data->header_len, 0);
+#endif
+        if (bytes_read <= 0)
+            return -1;
+        
+        data->header_len += bytes_read;
+    }
+    
+    data->header_len = 0;
+    
+    uint32_t msg_len = unpack_32i(data->header);
+    if (msg_len < LEN_FIELD_SIZE || msg_len - LEN_FIELD_SIZE > MAX_STREAM_SIZE)
+        return -1;
+    
+    *data_len = msg_len - LEN_FIELD_SIZE;
+    return 0;
+}
+
+int recv_client_body(thread_data_t *data, uint32_t data_len) {
+    /* recv_frame_body for client threads: the body lands in a new data->transmit_buffer.
+     * Returns 1 if stopped for a hot restart, with data->body_len bytes of it there */
+    if (!data->in_body) {
+        data->transmit_buffer = (char *) pool_alloc(data_len + 1);
+        data->body_len = 0;
+        data->body_size = data_len;
+        data->in_body = 1;
+    }
+    
+    while (data->body_len < data_len) {
+        if (restarting)
+            return 1;
+        
+#ifdef __linux__
+        int bytes_read = recv(data->sock_fd, data->transmit_buffer + data->body_len, data_len - data->body_len, MSG_DONTWAIT);
+        if (bytes_read == -1 && errno == EAGAIN) {
+            struct pollfd pfd = { data->sock_fd, POLLIN, 0 };
+            ppoll(&pfd, 1, NULL, &restart_wait_mask);
+            continue;
+        }
+#else
+        int bytes_read = recv(data->sock_fd, data->transmit_buffer + data->body_len, data_len - data->body_len, 0);
+#endif
+        if (bytes_read <= 0) {
+            pool_free(data->transmit_buffer);
+            data->in_body = 0;
+            return -1;
+        }
+        
+        data->body_len += bytes_read;
+    }
+    
+    data->transmit_buffer[data_len] = '\0';
+    data->in_body = 0;
+    return 0;
+}
+
+int recv_client_packet(thread_data_t *data, uint32_t *data_len) {
+    /* recv_client_header for local connections: the whole frame lands in a new
+     * data->transmit_buffer. Returns 1 if stopped for a hot restart */
+    data->transmit_buffer = (char *) pool_alloc(MAX_FRAME_SIZE + 1);
+    
+    while (1) {
+        if (restarting) {
+            pool_free(data->transmit_buffer);
+            return 1;
+        }
+        
+#ifdef __linux__
+        int len = recv_packet(data->sock_fd, data->transmit_buffer, MAX_FRAME_SIZE, MSG_DONTWAIT);
+        if (len == -1 && errno == EAGAIN) {
+            struct pollfd pfd = { data->sock_fd, POLLIN, 0 };
+            ppoll(&pfd, 1, NULL, &restart_wait_mask);
+            continue;
+        }
+#else
+        int len = recv_packet(data->sock_fd, data->transmit_buffer, MAX_FRAME_SIZE, 0);
+#endif
+        if (len <= 0) {
+            pool_free(data->transmit_buffer);
+            return -1;
+        }
+        
+        data->transmit_buffer[len] = '\0';
+        *data_len = len;
+        return 0;
+    }
+}
+
+size_t printable_prefix(const unsigned char *text, size_t len) {
+    /* Length of the leading whole vectors of text that are printable ASCII.
+     * Bytes are compared as signed, so 0x80 and up fail the > 0x1f test */
+    size_t i = 0;
+    
+#if defined(__AVX2__)
+    const __m256i low32 = _mm256_set1_epi8(0x1f), high32 = _mm256_set1_epi8(0x7f);
+    
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *) (text + i));
+        __m256i ok = _mm256_and_si256(_mm256_cmpgt_epi8(v, low32), _mm256_cmpgt_epi8(high32, v));
+        if (_mm256_movemask_epi8(ok) != -1)
+            return i;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i low16 = _mm_set1_epi8(0x1f), high16 = _mm_set1_epi8(0x7f);
+    
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *) (text + i));
+        __m128i ok = _mm_and_si128(_mm_cmpgt_epi8(v, low16), _mm_cmpgt_epi8(high16, v));
+        if (_mm_movemask_epi8(ok) != 0xffff)
+            return i;
+    }
+#endif
+    
+    return i;
+}
+
+size_t sanitize_text(char *text, size_t len, int final) {
+    /* Make text safe to print, in place and without changing its length: control
+     * characters (C0, DEL and C1) and bytes that aren't valid UTF-8 become '?'.
+     * NULs are kept, they end the text. If final is 0, a sequence cut short by the
+     * end of the buffer is left for the caller to complete; returns how many
+     * bytes are done */
+    unsigned char *bytes = (unsigned char *) text;
+    size_t i = 0;
+    
+    while (i < len) {
+        i += printable_prefix(bytes + i, len - i);
+        if (i == len)
+            break;
+        
+        unsigned char c = bytes[i];
+        if (c >= 0x20 && c < 0x7f) {
+            i++;
+            continue;
+        }
+        if (c < 0x80) {
+            if (c != '\0')
+                bytes[i] = '?';
+            i++;
+            continue;
+        }
+        
+        /* Lead byte: sequence length, and the smallest code point it may encode */
+        size_t n;
+        uint32_t code, min;
+        if (c >= 0xc2 && c <= 0xdf) {
+            n = 2; code = c & 0x1f; min = 0x80;
+        } else if (c >= 0xe0 && c <= 0xef) {
+            n = 3; code = c & 0x0f; min = 0x800;
+        } else if (c >= 0xf0 && c <= 0xf4) {
+            n = 4; code = c & 0x07; min = 0x10000;
+        } else {
+            bytes[i++] = '?';
+            continue;
+        }
+        
+        size_t k;
+        for (k = 1; k < n && i + k < len && (bytes[i + k] & 0xc0) == 0x80; k++)
+            code = (code << 6) | (bytes[i + k] & 0x3f);
+        
+        if (k < n && i + k == len && !final)
+            return i;
+        
+        if (k < n || code < min || code > 0x10ffff || (code >= 0xd800 && code <= 0xdfff)) {
+            bytes[i++] = '?';
+            continue;
+        }
+        
+        /* C1 controls are as dangerous to terminals as C0 ones */
+        if (code < 0xa0)
+            memset(bytes + i, '?', n);
+        
+        i += n;
+    }
+    
+    return len;
+}
+
+void free_filter(filter_t *filter) {
+    int i;
+    
+    if (filter == NULL)
+        return;
+    
+    for (i = 0; i < filter->pattern_count; i++)
+        free(filter->patterns[i]);
+    free(filter->patterns);
+    free(filter->hits);
+    free(filter->delta);
+    free(filter);
+}
+
+filter_t *compile_filter(const char *path) {
+    /* Build an Aho-Corasick automaton over the patterns in path, one per line and
+     * matched without regard to ASCII case. Missing transitions are filled in from
+     * the failure links, so the scan is one table lookup per byte. Bytes that
+     * appear in no pattern share class 0, which keeps the rows short, and the
+     * last column of each row holds the pattern matched there, or -1.
+     * Returns NULL if the file can't be read */
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return NULL;
+    
+    filter_t *filter = calloc(1, sizeof(filter_t));
+    char *line = NULL;
+    size_t line_size = 0, total_len = 0;
+    ssize_t len;
+    int pattern_size = 0, i, c;
+    
+    while ((len = getline(&line, &line_size, file)) != -1) {
+        while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+            line[--len] = '\0';
+        if (len == 0 || line[0] == '#')
+            continue;
+        
+        for (i = 0; i < len; i++) {
+            line[i] = tolower((unsigned char) line[i]);
+            if (filter->classes[(uint8_t) line[i]] == 0)
+                filter->classes[(uint8_t) line[i]] = ++filter->class_count;
+        }
+        
+        if (filter->pattern_count == pattern_size) {
+            pattern_size = pattern_size ? 2 * pattern_size : 64;
+            filter->patterns = realloc(filter->patterns, pattern_size * sizeof(char *));
+        }
+        filter->patterns[filter->pattern_count++] = strdup(line);
+        total_len += len;
+    }
+    free(line);
+    fclose(file);
+    
+    for (c = 'A'; c <= 'Z'; c++)
+        filter->classes[c] = filter->classes[tolower(c)];
+    filter->class_count++;
+    
+    /* The trie first; a 0 transition means no child yet, as nothing goes back to the root */
+    int classes = filter->class_count, max_states = total_len + 1;
+    int32_t *delta = calloc((size_t) max_states * classes, sizeof(int32_t));
+    int32_t *match = malloc(max_states * sizeof(int32_t));
+    filter->hits = calloc(filter->pattern_count ? filter->pattern_count : 1, sizeof(uint32_t));
+    filter->state_count = 1;
+    match[0] = -1;
+    
+    for (i = 0; i < filter->pattern_count; i++) {
+        const unsigned char *bytes = (const unsigned char *) filter->patterns[i];
+        int32_t state = 0;
+        
+        for (; *bytes; bytes++) {
+            int32_t *next = &delta[state * classes + filter->classes[*bytes]];
+            if (*next == 0) {
+                *next = filter->state_count++;
+                match[*next] = -1;
+            }
+            state = *next;
+        }
+        
+        if (match[state] == -1)
+            match[state] = i;
+    }
+    
+    /* Then breadth first, so each state's failure target is complete before its children */
+    int32_t *fail = calloc(filter->state_count, sizeof(int32_t));
+    int32_t *queue = malloc(filter->state_count * sizeof(int32_t));
+    int head = 0, tail = 0;
+    
+    for (c = 0; c < classes; c++)
+        if (delta[c] != 0)
+            queue[tail++] = delta[c];
+    
+    while (head < tail) {
+        int32_t state = queue[head++];
+        
+        for (c = 0; c < classes; c++) {
+            int32_t *next = &delta[state * classes + c];
+            int32_t fallback = delta[fail[state] * classes + c];
+            
+            if (*next == 0) {
+                *next = fallback;
+            } else {
+                fail[*next] = fallback;
+                if (match[*next] == -1)
+                    match[*next] = match[fallback];
+                queue[tail++] = *next;
+            }
+        }
+    }
+    
+    /* Renumber the states breadth first, so the shallow ones most bytes land on
+     * share a few cache lines, and store row offsets so the scan needs no multiply */
+    int row = classes + 1, k;
+    int32_t *renumber = malloc(filter->state_count * sizeof(int32_t));
+    
+    renumber[0] = 0;
+    for (k = 0; k < tail; k++)
+        renumber[queue[k]] = k + 1;
+    
+    filter->delta = malloc((size_t) filter->state_count * row * sizeof(int32_t));
+    for (k = 0; k < filter->state_count; k++) {
+        int32_t state = k == 0 ? 0 : queue[k - 1];
+        
+        for (c = 0; c < classes; c++)
+            filter->delta[k * row + c] = renumber[delta[state * classes + c]] * row;
+        filter->delta[k * row + classes] = match[state];
+    }
+    
+    free(renumber);
+    free(fail);
+    free(queue);
+    free(delta);
+    free(match);
+    
+    return filter;
+}
+
+int filter_match(const filter_t *filter, const char *text) {
+    /* Index of a pattern found in text, or -1 */
+    const unsigned char *bytes = (const unsigned char *) text;
+    const int32_t *delta = filter->delta;
+    int32_t state = 0, match_column = filter->class_count;
+    
+    for (; *bytes; bytes++) {
+        state = delta[state + filter->classes[*bytes]];
+        if (delta[state + match_column] != -1)
+            return delta[state + match_column];
+    }
+    
+    return -1;
+}
+
+void reload_filter(void) {
+    /* Recompile the pattern list if its file changed. Compiling happens here, off
+     * the fanout path; the transmit thread picks the result up between messages */
+    struct stat st;
+    
+    if (filter_path == NULL || stat(filter_path, &st) == -1)
+        return;
+    if (st.st_ino == filter_stat.st_ino && st.st_size == filter_stat.st_size &&
+        st.st_mtime == filter_stat.st_mtime)
+        return;
+    
+    filter_t *filter = compile_filter(filter_path);
+    if (filter == NULL) {
+        if (st.st_ino != filter_failed_stat.st_ino || st.st_size != filter_failed_stat.st_size ||
+            st.st_mtime != filter_failed_stat.st_mtime) {
+            filter_failed_stat = st;
+            
+            pthread_mutex_lock(&draw_mutex);
+            write_in_window("[info] Couldn't read %s, keeping the current filter: %s", filter_path, strerror(errno));
+            pthread_mutex_unlock(&draw_mutex);
+        }
+        return;
+    }
+    
+    filter_stat = st;
+    
+    /* A list the transmit thread never got to is simply replaced */
+    free_filter(__atomic_exchange_n(&pending_filter, filter, __ATOMIC_ACQ_REL));
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Compiled %d filter patterns into %d states", filter->pattern_count, filter->state_count);
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+filter_t *current_filter(void) {
+    /* The list in force, after swapping in a reloaded one; its counters start over.
+     * Called with filter_mutex held */
+    filter_t *reloaded = __atomic_exchange_n(&pending_filter, NULL, __ATOMIC_ACQ_REL);
+    if (reloaded != NULL) {
+        free_filter(active_filter);
+        active_filter = reloaded;
+    }
+    
+    return active_filter;
+}
+
+int filter_active(void) {
+    pthread_mutex_lock(&filter_mutex);
+    int active = current_filter() != NULL;
+    pthread_mutex_unlock(&filter_mutex);
+    
+    return active;
+}
+
+int screen_text(const char *text, const char *what, const char *username) {
+    /* Index of the pattern that blocks text, or -1; a hit is counted and reported */
+    int pattern = -1;
+    
+    pthread_mutex_lock(&filter_mutex);
+    filter_t *filter = current_filter();
+    if (filter != NULL && (pattern = filter_match(filter, text)) != -1) {
+        filter->hits[pattern]++;
+        
+        pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Blocked %s from %s: \"%s\" has %u hits",
+                        what, username, filter->patterns[pattern], filter->hits[pattern]);
+        pthread_mutex_unlock(&draw_mutex);
+    }
+    pthread_mutex_unlock(&filter_mutex);
+    
+    return pattern;
+}
+
+uint16_t intern(const char *string) {
+    /* Take a reference on the id of string, adding it if it's new.
+     * Called with client_list_mutex held */
+    uint32_t hash = hash_bytes(string, strlen(string), 2166136261u);
+    int *bucket = &intern_buckets[hash % INTERN_BUCKETS];
+    int id;
+    
+    for (id = *bucket - 1; id >= 0; id = interned[id].next - 1)
+        if (interned[id].hash == hash && strcmp(interned[id].string, string) == 0) {
+            interned[id].refs++;
+            return id;
+        }
+    
+    /* There are always free slots, see INTERN_SIZE */
+    for (id = 0; interned[id].string != NULL; id++)
+        ;
+    
+    interned[id].string = strdup(string);
+    interned[id].hash = hash;
+    interned[id].refs = 1;
+    interned[id].client = 0;
+    interned[id].version = 0;
+    interned[id].multicast_seq = 0;
+    interned[id].next = *bucket;
+    *bucket = id + 1;
+    
+    return id;
+}
+
+int intern_lookup(const char *string, size_t len) {
+    /* Id of the first len bytes of string without taking a reference, or -1.
+     * Called with client_list_mutex held */
+    uint32_t hash = hash_bytes(string, len, 2166136261u);
+    int id;
+    
+    for (id = intern_buckets[hash % INTERN_BUCKETS] - 1; id >= 0; id = interned[id].next - 1)
+        if (interned[id].hash == hash && strncmp(interned[id].string, string, len) == 0 &&
+            interned[id].string[len] == '\0')
+            return id;
+    
+    return -1;
+}
+
+void intern_release(uint16_t id) {
+    /* Drop a reference, freeing the string with the last one.
+     * Called with client_list_mutex held */
+    if (--interned[id].refs > 0)
+        return;
+    
+    int *link = &intern_buckets[interned[id].hash % INTERN_BUCKETS];
+    while (*link != id + 1)
+        link = &interned[*link - 1].next;
+    *link = interned[id].next;
+    
+    free(interned[id].string);
+    interned[id].string = NULL;
+}
+
+const char *interned_string(uint16_t id) {
+    /* Stays valid for as long as the caller holds a reference */
+    return interned[id].string;
+}
+
+void record_history(uint32_t seq, uint32_t multicast_seq, uint16_t username, uint16_t room, const char *data) {
+    /* Overwrite the oldest entry in the ring; called with client_list_mutex held */
+    history_entry_t *entry = &history[seq % HISTORY_SIZE];
+    
+    if (entry->seq != 0) {
+        intern_release(entry->username);
+        intern_release(entry->room);
+    }
+    pool_free(entry->data);
+    
+    interned[username].refs++;
+    interned[room].refs++;
+    
+    entry->seq = seq;
+    entry->multicast_seq = multicast_seq;
+    entry->username = username;
+    entry->room = room;
+    entry->data = pool_strdup(data);
+}
+
+uint32_t format_relayed_message(char **frame, const char *data, uint32_t origin, uint32_t message_id, const char *room) {
+    /* Between servers, the globally unique message id and the room go after the NUL.
+     * The frame comes from the buffer pool */
+    uint32_t data_len = strlen(data) + 1;
+    uint32_t max_len = data_len + 8 + 1 + 10 + 1 + strlen(room) + 1;
+    
+    *frame = (char *) pool_alloc(max_len);
+    memcpy(*frame, data, data_len);
+    
+    return data_len + snprintf(*frame + data_len, max_len - data_len, "%08x:%u:%s", origin, message_id, room) + 1;
+}
+
+void queue_relayed_message(int id, const char *data, uint32_t origin, uint32_t message_id, const char *room) {
+    char *frame;
+    uint32_t frame_len = format_relayed_message(&frame, data, origin, message_id, room);
+    
+    queue_frame(id, LANE_CHAT, frame, frame_len);
+    
+    pool_free(frame);
+}
+
+int already_seen(uint32_t origin, uint32_t message_id) {
+    /* Sliding window per origin node: remembers which of its last DEDUPE_WINDOW
+     * ids went through here. Anything older than the window counts as seen */
+    dedupe_window_t *window = NULL;
+    int i;
+    
+    for (i = 0; i < dedupe_window_count; i++)
+        if (dedupe_windows[i].node_id == origin)
+            window = &dedupe_windows[i];
+    
+    if (window == NULL) {
+        /* Recycle the slots round-robin once the table is full */
+        window = &dedupe_windows[dedupe_window_count < MAX_NODES ? dedupe_window_count++ : origin % MAX_NODES];
+        memset(window, 0, sizeof(dedupe_window_t));
+        window->node_id = origin;
+    }
+    
+    if (message_id > window->max_seq) {
+        /* Slide forward, forgetting the ids that fall out of the window */
+        uint32_t id;
+        if (message_id - window->max_seq >= DEDUPE_WINDOW)
+            memset(window->seen, 0, sizeof(window->seen));
+        else
+            for (id = window->max_seq + 1; id <= message_id; id++)
+                window->seen[(id % DEDUPE_WINDOW) / 64] &= ~(1ULL << (id % 64));
+        
+        window->max_seq = message_id;
+    } else if (window->max_seq - message_id >= DEDUPE_WINDOW) {
+        return 1;
+    }
+    
+    uint64_t bit = 1ULL << (message_id % 64);
+    uint64_t *word = &window->seen[(message_id % DEDUPE_WINDOW) / 64];
+    
+    if (*word & bit)
+        return 1;
+    
+    *word |= bit;
+    return 0;
+}
+
+int add_client(int sock_fd, const char *username, const char *room, int is_peer, uint32_t resume_seq, uint32_t resume_boot) {
+    /* Register a connection in a free slot and return its id, or -1 if full.
+     * resume_boot is the boot id the client's resume_seq came from, 0 if it didn't say */
+    pthread_mutex_lock(&client_list_mutex);
+    
+    /* Reuse the slot of a client that has disconnected */
+    int id;
+    for (id = 0; id < MAX_CLIENTS; id++)
+        if (!(client_hot[id].flags & CLIENT_ACTIVE))
+            break;
+    
+    if (id == MAX_CLIENTS) {
+        pthread_mutex_unlock(&client_list_mutex);
+        return -1;
+    }
+    
+    client_data[id].sock_fd = sock_fd;
+    client_data[id].username = intern(username);
+    client_data[id].client_id = id;
+    client_data[id].generation++;
+    client_data[id].close_when_drained = 0;
+    client_data[id].header_len = 0;
+    client_data[id].in_body = 0;
+    client_data[id].parked = 0;
+    client_data[id].batching = 0;
+    
+    /* Local connections keep their type across a hot restart, so ask the socket */
+    int type = 0;
+    socklen_t type_len = sizeof(type);
+    client_data[id].packet = sock_fd != -1 && getsockopt(sock_fd, SOL_SOCKET, SO_TYPE, &type, &type_len) == 0 &&
+                             type == SOCK_SEQPACKET;
+    client_hot[id].room = intern(room);
+    
+    /* Tell the client which run of the server numbered the messages that follow */
+    if (!is_peer && sock_fd != -1) {
+        char epoch[16];
+        snprintf(epoch, sizeof(epoch), "\x7f" "E%08x", boot_id);
+        queue_message(id, LANE_CONTROL, epoch);
+    }
+    
+    /* Catch the client up before it can see any new message. Numbers from another
+     * run, or past our last one, say nothing about what it missed here: that's all
+     * of it */
+    if (resume_seq > 0) {
+        if ((resume_boot != 0 && resume_boot != boot_id) || resume_seq > last_seq)
+            resume_seq = 0;
+        replay_history(id, client_data[id].username, client_hot[id].room, resume_seq);
+    }
+    
+    /* Ring readers have no socket to write to */
+    if (sock_fd != -1) {
+        struct timeval send_timeout = { SEND_TIMEOUT, 0 };
+        setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout));
+        
+        uint32_t *writer_arg = malloc(2 * sizeof(uint32_t));
+        writer_arg[0] = id;
+        writer_arg[1] = client_data[id].generation;
+        pthread_create(&client_data[id].writer, NULL, writer_thread, writer_arg);
+        
+        /* The reading thread pins itself to the same core once it runs */
+        if (pinned_cpu_count > 0) {
+            client_data[id].cpu = connection_cpu(sock_fd);
+            pin_thread(client_data[id].writer, client_data[id].cpu);
+        }
+    }
+    
+    client_hot[id].sock_fd = sock_fd;
+    client_hot[id].flags = CLIENT_ACTIVE | (is_peer ? CLIENT_PEER : 0);
+    
+    /* Private messages find the client by name; the latest of namesakes wins */
+    if (!is_peer) {
+        interned[client_data[id].username].client = id + 1;
+        
+        presence_dirty = 1;
+        pthread_cond_signal(&presence_cond);
+    }
+    
+    /* Offer batch frames with an empty one */
+    if (!is_peer && sock_fd != -1)
+        queue_frame(id, LANE_CONTROL, "\x7f" "B", 2);
+    
+    /* Offer the room's group; the client stays on TCP until it has joined */
+    if (!is_peer && sock_fd != -1 && multicast_fd != -1) {
+        struct sockaddr_in group;
+        char announce[INET_ADDRSTRLEN + 16];
+        
+        multicast_group(client_hot[id].room, &group);
+        announce[0] = '\x7f';
+        announce[1] = 'M';
+        inet_ntop(AF_INET, &group.sin_addr, announce + 2, INET_ADDRSTRLEN);
+        snprintf(announce + strlen(announce), 16, ":%u", ntohs(group.sin_port));
+        queue_message(id, LANE_CONTROL, announce);
+    }
+    
+    if (id == client_counter)
+        client_counter++;
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    return id;
+}
+
+void remove_client(int id) {
+    /* Free the slot of a connection that went away; called with client_list_mutex held */
+    uint16_t username = client_data[id].username;
+    int i;
+    
+    /* Private messages to the name go to a namesake still here, if there is one */
+    if (interned[username].client == id + 1) {
+        interned[username].client = 0;
+        
+        for (i = 0; i < client_counter; i++)
+            if (i != id && (client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER)) == CLIENT_ACTIVE &&
+                client_data[i].username == username)
+                interned[username].client = i + 1;
+    }
+    
+    /* The room only hears about it if it heard of the join. Every listed client
+     * leaves at most once per batch, so presence_leaves can't overflow */
+    if (client_hot[id].flags & CLIENT_LISTED) {
+        presence_leave_t *leave = &presence_leaves[presence_leave_count++];
+        leave->username = client_data[id].username;
+        leave->room = client_hot[id].room;
+        interned[leave->username].refs++;
+        interned[leave->room].refs++;
+        
+        presence_dirty = 1;
+        pthread_cond_signal(&presence_cond);
+    }
+    
+    intern_release(client_data[id].username);
+    intern_release(client_hot[id].room);
+    client_hot[id].flags = 0;
+    
+    /* Tell the writer to stop */
+    drop_queued_frames(client_hot[id].queue);
+    client_data[id].generation++;
+    pthread_cond_signal(&client_hot[id].queue->cond);
+}
+
+void *peer_connector_thread(void *arg) {
+    /* Keep a link to one cluster member up, reconnecting when it drops, until
+     * gossip declares the member dead.
+     * A peer introduces itself with 0x7F 'P' and its node id instead of a username */
+    peer_link_t *link = (peer_link_t *) arg;
+    char *host = link->host, *port = link->port;
+    
+    while (1) {
+        pthread_mutex_lock(&members_mutex);
+        member_t *member = find_member(link->node_id);
+        if (member->state == MEMBER_DEAD) {
+            member->linked = 0;
+            pthread_mutex_unlock(&members_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&members_mutex);
+        
+        int sock_fd = transport_connect(host, port);
+        
+        if (sock_fd != -1) {
+            char *handshake;
+            asprintf(&handshake, "\x7fP%08x", node_id);
+            send_message(sock_fd, handshake);
+            
+            int id = add_client(sock_fd, handshake, "", 1, 0, 0);
+            free(handshake);
+            if (id != -1) {
+                client_data[id].peer_node_id = link->node_id;
+                
+                pthread_mutex_lock(&draw_mutex);
+                write_in_window("[info] Linked to peer %s:%s", host, port);
+                pthread_mutex_unlock(&draw_mutex);
+                
+                /* Relay from the peer on this thread until the link drops */
+                client_thread_loop(&client_data[id]);
+            } else {
+                close(sock_fd);
+            }
+        }
+        
+        sleep(PEER_RETRY_DELAY);
+    }
+    
+    free(host);
+    free(port);
+    free(link);
+    
+    return NULL;
+}
+
+void replay_history(int id, uint16_t username, uint16_t room, uint32_t resume_seq) {
+    /* Send everything newer than resume_seq in the client's room that is still in
+     * the ring, except the client's own messages which it has already displayed.
+     * Called with client_list_mutex held */
+    uint32_t seq = resume_seq + 1;
+    
+    if (last_seq >= HISTORY_SIZE && seq <= last_seq - HISTORY_SIZE)
+        seq = last_seq - HISTORY_SIZE + 1;
+    
+    for (; seq <= last_seq; seq++) {
+        history_entry_t *entry = &history[seq % HISTORY_SIZE];
+        
+        if (entry->seq == seq && entry->username != username && entry->room == room)
+            queue_sequenced_message(id, entry->data, seq);
+    }
+}
+
+void multicast_init(const char *spec, const char *interface) {
+    /* Parse <group>:<port> and open the socket the datagrams go out on */
+    char group[INET_ADDRSTRLEN];
+    const char *port = strrchr(spec, ':');
+    
+    memset(&multicast_base, 0, sizeof(multicast_base));
+    multicast_base.sin_family = AF_INET;
+    if (port == NULL || port - spec >= sizeof(group)) {
+        fprintf(stderr, "CHAT_MULTICAST should be <group>:<port>\n");
+        exit(-1);
+    }
+    
+    memcpy(group, spec, port - spec);
+    group[port - spec] = '\0';
+    multicast_base.sin_port = htons(atoi(port + 1));
+    if (inet_pton(AF_INET, group, &multicast_base.sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(multicast_base.sin_addr.s_addr))) {
+        fprintf(stderr, "CHAT_MULTICAST should be <group>:<port>\n");
+        exit(-1);
+    }
+    
+    if ((multicast_fd = socket(AF_INET, SOCK_DGRAM, 0)) == -1) {
+        perror("multicast");
+        exit(-1);
+    }
+    
+    /* Stay on the LAN, and reach clients on this host too */
+    unsigned char ttl = 1, loop = 1;
+    setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+    setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    
+    struct in_addr interface_address;
+    if (interface != NULL &&
+        (inet_pton(AF_INET, interface, &interface_address) != 1 ||
+         setsockopt(multicast_fd, IPPROTO_IP, IP_MULTICAST_IF, &interface_address, sizeof(interface_address)) == -1)) {
+        perror("multicast interface");
+        exit(-1);
+    }
+}
+
+void multicast_group(uint16_t room, struct sockaddr_in *group) {
+    *group = multicast_base;
+    group->sin_addr.s_addr = htonl(ntohl(multicast_base.sin_addr.s_addr) + interned[room].hash % MULTICAST_GROUPS);
+}
+
+void multicast_send(uint16_t room, uint32_t multicast_seq, const char *username, const char *data, uint32_t seq) {
+    /* One datagram to the room's group; a heartbeat if username is NULL.
+     * Called with client_list_mutex held */
+    char datagram[MULTICAST_MAX_DATAGRAM];
+    const char *room_name = interned_string(room);
+    uint32_t len = 8;
+    int fields;
+    
+    pack_32i(node_id, datagram);
+    pack_32i(multicast_seq, datagram + 4);
+    
+    if (username == NULL)
+        fields = snprintf(datagram + len, sizeof(datagram) - len, "%c%s", 0, room_name);
+    else
+        fields = snprintf(datagram + len, sizeof(datagram) - len, "%s%c%s%c%s%c%u",
+                          username, 0, room_name, 0, data, 0, seq);
+    
+    /* Too long: listeners find the gap and fetch it over TCP */
+    if (fields < 0 || len + fields + 1 > sizeof(datagram))
+        return;
+    len += fields + 1;
+    
+    struct sockaddr_in group;
+    multicast_group(room, &group);
+    sendto(multicast_fd, datagram, len, 0, (struct sockaddr *) &group, sizeof(group));
+}
+
+void multicast_join(int id) {
+    /* The client has joined its room's group: from here on its room chat comes by
+     * multicast. Called with client_list_mutex held */
+    char reply[32];
+    
+    client_hot[id].flags |= CLIENT_MULTICAST;
+    snprintf(reply, sizeof(reply), "\x7fJ%08x:%u", node_id, interned[client_hot[id].room].multicast_seq);
+    queue_message(id, LANE_CHAT, reply);
+}
+
+void multicast_retransmit(int id, const char *range) {
+    /* Send the client the room messages numbered first to last over TCP, in order,
+     * from the history. Called with client_list_mutex held */
+    uint16_t room = client_hot[id].room, username = client_data[id].username;
+    uint32_t first, last, found = 0, seq;
+    char reply[64];
+    
+    if (sscanf(range, "%u-%u", &first, &last) != 2 || first == 0 || first > last)
+        return;
+    if (last > interned[room].multicast_seq)
+        last = interned[room].multicast_seq;
+    
+    seq = last_seq >= HISTORY_SIZE ? last_seq - HISTORY_SIZE + 1 : 1;
+    for (; seq <= last_seq; seq++) {
+        history_entry_t *entry = &history[seq % HISTORY_SIZE];
+        
+        if (entry->seq != seq || entry->room != room ||
+            entry->multicast_seq < first || entry->multicast_seq > last)
+            continue;
+        
+        /* The client's own messages count as delivered; it displayed them */
+        if (entry->username != username)
+            queue_sequenced_message(id, entry->data, seq);
+        found++;
+    }
+    
+    if (last >= first && found < last - first + 1) {
+        snprintf(reply, sizeof(reply), "[info] %u messages are no longer available", last - first + 1 - found);
+        queue_message(id, LANE_CHAT, reply);
+    }
+    
+    snprintf(reply, sizeof(reply), "\x7fN%u", last);
+    queue_message(id, LANE_CHAT, reply);
+}
+
+void multicast_heartbeat(void) {
+    /* Repeat the last room seq of every room that has listeners */
+    int i, j;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    for (i = 0; i < client_counter; i++) {
+        if (!(client_hot[i].flags & CLIENT_MULTICAST))
+            continue;
+        
+        /* Once per room */
+        for (j = 0; j < i; j++)
+            if ((client_hot[j].flags & CLIENT_MULTICAST) && client_hot[j].room == client_hot[i].room)
+                break;
+        
+        if (j == i)
+            multicast_send(client_hot[i].room, interned[client_hot[i].room].multicast_seq, NULL, NULL, 0);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+}
+
+long long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+uint32_t trace_sample(void) {
+    /* Trace id for a new message, or 0 if it isn't traced */
+    if (trace_every == 0)
+        return 0;
+    
+    uint32_t count = __atomic_add_fetch(&trace_counter, 1, __ATOMIC_RELAXED);
+    return count % trace_every == 0 ? count / trace_every : 0;
+}
+
+void trace_record(uint32_t trace_id, int stage, long long start_us, uint32_t arg) {
+    /* Add a stage of a traced message that started at start_us and ends now */
+    if (trace_id == 0)
+        return;
+    
+    if (trace_buffer == NULL) {
+        /* Take over the buffer of a thread that exited, or publish a new one */
+        trace_buffer_t *buffer;
+        for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+            int retired = 1;
+            if (__atomic_compare_exchange_n(&buffer->retired, &retired, 0, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+                break;
+        }
+        
+        if (buffer == NULL) {
+            buffer = (trace_buffer_t *) calloc(1, sizeof(trace_buffer_t));
+            buffer->tid = __atomic_add_fetch(&trace_tids, 1, __ATOMIC_RELAXED);
+            buffer->next = __atomic_load_n(&trace_buffers, __ATOMIC_RELAXED);
+            while (!__atomic_compare_exchange_n(&trace_buffers, &buffer->next, buffer, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+                ;
+        }
+        
+        trace_buffer = buffer;
+    }
+    
+    uint32_t head = trace_buffer->head;
+    trace_event_t *event = &trace_buffer->events[head % TRACE_EVENTS];
+    event->start_us = start_us;
+    event->dur_us = (uint32_t) (now_us() - start_us);
+    event->trace_id = trace_id;
+    event->stage = stage;
+    event->arg = arg;
+    __atomic_store_n(&trace_buffer->head, head + 1, __ATOMIC_RELEASE);
+}
+
+void trace_release(void) {
+    /* Called by a thread on its way out; the events stay until the buffer is reused */
+    if (trace_buffer)
+        __atomic_store_n(&trace_buffer->retired, 1, __ATOMIC_RELEASE);
+    trace_buffer = NULL;
+}
+
+void pin_thread(pthread_t thread, int cpu) {
+    /* Other systems have no way to pin threads; there, only busy polling applies */
+#ifdef __linux__
+    if (cpu < 0 || cpu >= CPU_SETSIZE)
+        return;
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(thread, sizeof(cpus), &cpus);
+#endif
+}
+
+int connection_cpu(int sock_fd) {
+    /* Core for a new connection's threads; called with client_list_mutex held.
+     * Reading on the core that takes the socket's interrupts keeps its data in
+     * one cache. The first core is left to the transmit thread if there are others */
+    int first = pinned_cpu_count > 1 ? 1 : 0, cpu = -1, i;
+    
+#ifdef SO_INCOMING_CPU
+    socklen_t cpu_len = sizeof(cpu);
+    getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &cpu_len);
+#endif
+    
+    for (i = first; i < pinned_cpu_count; i++)
+        if (pinned_cpus[i] == cpu)
+            return cpu;
+    
+    return pinned_cpus[first + next_connection_cpu++ % (pinned_cpu_count - first)];
+}
+
+void cpu_relax(void) {
+    /* Spin-wait hint, so a busy-polling thread leaves its sibling hyperthread alone */
+#if defined(__SSE2__)
+    _mm_pause();
+#endif
+}
+
+void request_trace_dump(int signum) {
+    trace_dump_requested = 1;
+}
+
+void dump_trace(void) {
+    /* Write every thread's events to ptmp_trace_<pid>.json, for chrome://tracing or
+     * Perfetto. Events written while we read may come out torn */
+    static const char *stage_names[] = { "recv", "handoff", "fanout", "queued", "write" };
+    static const char *arg_names[] = { "slot", "slot", "recipients", "slot", "slot" };
+    char path[64];
+    int count = 0;
+    
+    snprintf(path, sizeof(path), "ptmp_trace_%d.json", (int) getpid());
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Can't write %s: %s", path, strerror(errno));
+        pthread_mutex_unlock(&draw_mutex);
+        return;
+    }
+    
+    fprintf(file, "{\"traceEvents\":[");
+    
+    trace_buffer_t *buffer;
+    for (buffer = __atomic_load_n(&trace_buffers, __ATOMIC_ACQUIRE); buffer; buffer = buffer->next) {
+        uint32_t head = __atomic_load_n(&buffer->head, __ATOMIC_ACQUIRE), i;
+        
+        for (i = head > TRACE_EVENTS ? head - TRACE_EVENTS : 0; i < head; i++) {
+            trace_event_t *event = &buffer->events[i % TRACE_EVENTS];
+            fprintf(file, "%s\n{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%lld,\"dur\":%u,\"pid\":1,\"tid\":%d,"
+                    "\"args\":{\"msg\":%u,\"%s\":%u}}", count++ ? "," : "", stage_names[event->stage],
+                    event->start_us, event->dur_us, buffer->tid, event->trace_id, arg_names[event->stage], event->arg);
+        }
+    }
+    
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Wrote %d trace events to %s", count, path);
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+uint16_t local_load(void) {
+    /* Number of chat clients connected to this node */
+    uint16_t load = 0;
+    int i;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    for (i = 0; i < client_counter; i++)
+        if ((client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER)) == CLIENT_ACTIVE)
+            load++;
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    return load;
+}
+
+member_t *find_member(uint32_t id) {
+    /* Called with members_mutex held */
+    int i;
+    for (i = 0; i < member_count; i++)
+        if (members[i].node_id == id)
+            return &members[i];
+    
+    return NULL;
+}
+
+void set_member_state(member_t *member, int state) {
+    /* Called with members_mutex held */
+    static const char *state_names[] = { "alive", "suspect", "dead" };
+    
+    member->state = state;
+    member->state_changed_ms = now_ms();
+    member->gossip_left = GOSSIP_RETRANSMITS;
+    ring_dirty = 1;
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Node %08x is %s", member->node_id, state_names[state]);
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+void link_member(member_t *member) {
+    /* Federate with a newly discovered node. Only the node with the lower id
+     * dials, so each pair ends up with one link. Called with members_mutex held */
+    attach_member_ring(member);
+    
+    if (member->linked || member->node_id < node_id)
+        return;
+    
+    peer_link_t *link = (peer_link_t *) malloc(sizeof(peer_link_t));
+    link->host = strdup(inet_ntoa(member->address.sin_addr));
+    asprintf(&link->port, "%u", ntohs(member->address.sin_port));
+    link->node_id = member->node_id;
+    
+    member->linked = 1;
+    
+    pthread_t peer_handle;
+    pthread_create(&peer_handle, NULL, peer_connector_thread, (void *) link);
+}
+
+void apply_update(uint32_t id, struct sockaddr_in *address, uint32_t member_incarnation, int state, uint16_t load) {
+    /* Merge one piece of membership news, SWIM style: a higher incarnation wins,
+     * suspicion overrides alive at the same incarnation and dead overrides both.
+     * Called with members_mutex held */
+    if (id == node_id) {
+        /* Someone suspects us: refute with a new incarnation, carried by our next messages */
+        if (state != MEMBER_ALIVE && member_incarnation >= incarnation)
+            incarnation = member_incarnation + 1;
+        return;
+    }
+    
+    member_t *member = find_member(id);
+    if (member == NULL) {
+        if (state == MEMBER_DEAD || member_count == MAX_NODES)
+            return;
+        
+        /* Gossip our whole view again so the newcomer learns about everyone */
+        int i;
+        for (i = 0; i < member_count; i++)
+            members[i].gossip_left = GOSSIP_RETRANSMITS;
+        
+        member = &members[member_count++];
+        memset(member, 0, sizeof(member_t));
+        member->node_id = id;
+        member->address = *address;
+        member->incarnation = member_incarnation;
+        member->load = load;
+        set_member_state(member, state);
+        
+        if (state == MEMBER_ALIVE)
+            link_member(member);
+        return;
+    }
+    
+    if (member_incarnation >= member->incarnation)
+        member->load = load;
+    
+    int newer = member_incarnation > member->incarnation;
+    int same = member_incarnation == member->incarnation;
+    
+    if ((state == MEMBER_ALIVE && newer) ||
+        (state == MEMBER_SUSPECT && (newer || (same && member->state == MEMBER_ALIVE))) ||
+        (state == MEMBER_DEAD && (newer || same) && member->state != MEMBER_DEAD)) {
+        member->incarnation = member_incarnation;
+        member->address = *address;
+        set_member_state(member, state);
+        
+        if (state == MEMBER_ALIVE)
+            link_member(member);
+    }
+}
+
+void gossip_send(char type, struct sockaddr_in *destination, uint32_t seq, uint32_t target, struct sockaddr_in *target_address) {
+    /* Gossip datagram:
+     * 0x7F 'G' <type> <update count> <sender id> <sender port> <sender incarnation> <sender load>
+     * <probe seq> <target id> <target ip> <target port> <updates...>
+     * Each update is <id> <ip> <port> <incarnation> <state> <load>.
+     * Recent membership changes ride along on every ping and ack */
+    char packet[GOSSIP_HEADER_SIZE + GOSSIP_MAX_UPDATES * GOSSIP_UPDATE_SIZE];
+    int count = 0, i;
+    
+    memset(packet, 0, GOSSIP_HEADER_SIZE);
+    packet[0] = '\x7f';
+    packet[1] = 'G';
+    packet[2] = type;
+    
+    pthread_mutex_lock(&members_mutex);
+    pack_32i(node_id, packet + 4);
+    pack_16i(chat_port, packet + 8);
+    pack_32i(incarnation, packet + 10);
+    pack_16i(local_load(), packet + 14);
+    pack_32i(seq, packet + 16);
+    pack_32i(target, packet + 20);
+    if (target_address) {
+        memcpy(packet + 24, &target_address->sin_addr, 4);
+        memcpy(packet + 28, &target_address->sin_port, 2);
+    }
+    
+    for (i = 0; i < member_count && count < GOSSIP_MAX_UPDATES; i++) {
+        if (members[i].gossip_left == 0)
+            continue;
+        
+        char *update = packet + GOSSIP_HEADER_SIZE + count * GOSSIP_UPDATE_SIZE;
+        pack_32i(members[i].node_id, update);
+        memcpy(update + 4, &members[i].address.sin_addr, 4);
+        memcpy(update + 8, &members[i].address.sin_port, 2);
+        pack_32i(members[i].incarnation, update + 10);
+        update[14] = members[i].state;
+        pack_16i(members[i].load, update + 15);
+        
+        members[i].gossip_left--;
+        count++;
+    }
+    pthread_mutex_unlock(&members_mutex);
+    
+    packet[3] = count;
+    sendto(gossip_fd, packet, GOSSIP_HEADER_SIZE + count * GOSSIP_UPDATE_SIZE, 0,
+           (struct sockaddr *) destination, sizeof(struct sockaddr_in));
+}
+
+void handle_gossip(char *packet, int len, struct sockaddr_in *from) {
+    if (len < GOSSIP_HEADER_SIZE)
+        return;
+    
+    uint32_t sender = unpack_32i(packet + 4);
+    if (sender == node_id)
+        return; /* Our own LAN broadcast */
+    
+    int count = (unsigned char) packet[3], i;
+    if (count > GOSSIP_MAX_UPDATES || len < GOSSIP_HEADER_SIZE + count * GOSSIP_UPDATE_SIZE)
+        return;
+    
+    /* Anyone can send to the discovery port: drop the whole datagram if any state
+     * is one we don't know, rather than storing it and gossiping it on */
+    for (i = 0; i < count; i++) {
+        unsigned char state = packet[GOSSIP_HEADER_SIZE + i * GOSSIP_UPDATE_SIZE + 14];
+        if (state > MEMBER_DEAD)
+            return;
+    }
+    
+    /* Gossip goes to the same port number as the chat */
+    struct sockaddr_in sender_address = *from;
+    sender_address.sin_port = htons(unpack_16i(packet + 8));
+    
+    uint32_t seq = unpack_32i(packet + 16);
+    uint32_t target = unpack_32i(packet + 20);
+    
+    pthread_mutex_lock(&members_mutex);
+    /* Hearing from a node directly proves it is alive */
+    apply_update(sender, &sender_address, unpack_32i(packet + 10), MEMBER_ALIVE, unpack_16i(packet + 14));
+    
+    for (i = 0; i < count; i++) {
+        char *update = packet + GOSSIP_HEADER_SIZE + i * GOSSIP_UPDATE_SIZE;
+        struct sockaddr_in address;
+        
+        memset(&address, 0, sizeof(address));
+        address.sin_family = AF_INET;
+        memcpy(&address.sin_addr, update + 4, 4);
+        memcpy(&address.sin_port, update + 8, 2);
+        
+        apply_update(unpack_32i(update), &address, unpack_32i(update + 10), (unsigned char) update[14],
+                     unpack_16i(update + 15));
+    }
+    pthread_mutex_unlock(&members_mutex);
+    
+    if (packet[2] == 'p') {
+        /* Ping, or a LAN join (target 0): answer with an ack */
+        if (target == 0 || target == node_id)
+            gossip_send('a', &sender_address, seq, node_id, NULL);
+    } else if (packet[2] == 'r') {
+        /* Ping-req: probe the target on the requester's behalf and remember where the ack goes */
+        struct sockaddr_in target_address;
+        memset(&target_address, 0, sizeof(target_address));
+        target_address.sin_family = AF_INET;
+        memcpy(&target_address.sin_addr, packet + 24, 4);
+        memcpy(&target_address.sin_port, packet + 28, 2);
+        
+        gossip_relay_t *relay = &relays[relay_seq % GOSSIP_MAX_RELAYS];
+        relay->seq = GOSSIP_RELAY_SEQ_BASE + relay_seq++;
+        relay->requester = sender_address;
+        relay->requester_seq = seq;
+        relay->target = target;
+        
+        gossip_send('p', &target_address, relay->seq, target, NULL);
+    } else if (packet[2] == 'a') {
+        if (seq == probe_seq && target == probe_target) {
+            probe_acked = 1;
+        } else {
+            /* Ack for a ping-req we relayed: pass it back to the requester */
+            for (i = 0; i < GOSSIP_MAX_RELAYS; i++)
+                if (relays[i].seq == seq && relays[i].target == target) {
+                    gossip_send('a', &relays[i].requester, relays[i].requester_seq, target, NULL);
+                    relays[i].seq = 0;
+                }
+        }
+    }
+}
+
+void gossip_join(broadcast_data_t *broadcast_data) {
+    /* Ping with no target to the LAN broadcast address and to the seed peers */
+    struct sockaddr_in destination;
+    struct addrinfo hints, *result;
+    int i;
+    
+    memset(&destination, 0, sizeof(destination));
+    destination.sin_family = AF_INET;
+    destination.sin_port = htons(chat_port);
+    destination.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+    gossip_send('p', &destination, 0, 0, NULL);
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    
+    for (i = 0; i < broadcast_data->peer_count; i++) {
+        char *host = strdup(broadcast_data->peers[i]);
+        char *port = strrchr(host, ':');
+        if (port != NULL)
+            *port++ = '\0';
+        
+        if (port != NULL && getaddrinfo(host, port, &hints, &result) == 0) {
+            gossip_send('p', (struct sockaddr_in *) result->ai_addr, 0, 0, NULL);
+            freeaddrinfo(result);
+        }
+        
+        free(host);
+    }
+}
+
+member_t *random_member(uint32_t except) {
+    /* A random live member other than except, or NULL. Called with members_mutex held */
+    member_t *candidates[MAX_NODES];
+    int count = 0, i;
+    
+    for (i = 0; i < member_count; i++)
+        if (members[i].state != MEMBER_DEAD && members[i].node_id != except)
+            candidates[count++] = &members[i];
+    
+    return count ? candidates[random() % count] : NULL;
+}
+
+void gossip_tick(broadcast_data_t *broadcast_data) {
+    /* One step of the SWIM failure detector; called whenever the socket is idle or after a datagram */
+    long long now = now_ms();
+    int i;
+    
+    pthread_mutex_lock(&members_mutex);
+    member_t *target = probe_target ? find_member(probe_target) : NULL;
+    
+    if (target && !probe_acked) {
+        if (now - probe_started_ms >= PROTOCOL_PERIOD_MS) {
+            /* No direct or indirect ack within the period */
+            if (target->state == MEMBER_ALIVE)
+                set_member_state(target, MEMBER_SUSPECT);
+            probe_target = 0;
+        } else if (!probe_indirect_sent && now - probe_started_ms >= PING_TIMEOUT_MS) {
+            /* Ask a few others to probe it, in case only our path is bad */
+            struct sockaddr_in target_address = target->address;
+            struct sockaddr_in helpers[INDIRECT_PROBES];
+            int helper_count = 0;
+            
+            for (i = 0; i < INDIRECT_PROBES; i++) {
+                member_t *helper = random_member(probe_target);
+                if (helper)
+                    helpers[helper_count++] = helper->address;
+            }
+            
+            probe_indirect_sent = 1;
+            pthread_mutex_unlock(&members_mutex);
+            
+            for (i = 0; i < helper_count; i++)
+                gossip_send('r', &helpers[i], probe_seq, probe_target, &target_address);
+            
+            pthread_mutex_lock(&members_mutex);
+        }
+    }
+    
+    if (now < next_probe_ms) {
+        pthread_mutex_unlock(&members_mutex);
+        return;
+    }
+    
+    next_probe_ms = now + PROTOCOL_PERIOD_MS;
+    
+    /* Suspects that didn't refute in time are dead; the dead are forgotten later */
+    for (i = 0; i < member_count; i++) {
+        if (members[i].state == MEMBER_SUSPECT && now - members[i].state_changed_ms >= SUSPECT_TIMEOUT_MS)
+            set_member_state(&members[i], MEMBER_DEAD);
+        
+        if (members[i].state == MEMBER_DEAD && now - members[i].state_changed_ms >= DEAD_REAP_MS &&
+            !members[i].linked && !members[i].ring_attached)
+            members[i--] = members[--member_count];
+    }
+    
+    /* Probe a random member */
+    target = random_member(0);
+    if (target) {
+        struct sockaddr_in target_address = target->address;
+        
+        probe_target = target->node_id;
+        probe_seq++;
+        probe_started_ms = now;
+        probe_acked = probe_indirect_sent = 0;
+        pthread_mutex_unlock(&members_mutex);
+        
+        gossip_send('p', &target_address, probe_seq, probe_target, NULL);
+    } else {
+        pthread_mutex_unlock(&members_mutex);
+        
+        /* Alone: keep knocking, the seeds may have started after us */
+        gossip_join(broadcast_data);
+    }
+}
+
+#ifdef __linux__
+void ring_socket_address(uint32_t id, struct sockaddr_un *address, socklen_t *address_len) {
+    /* Abstract socket named after the producing node; it is only reachable from
+     * the same host, which is exactly when the ring can be shared */
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    int name_len = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "ptmp-ring-%08x", id);
+    *address_len = offsetof(struct sockaddr_un, sun_path) + 1 + name_len;
+}
+
+void ring_init(void) {
+    /* Create our outgoing ring; sealed so a consumer can't resize it under us */
+    if ((local_ring_fd = memfd_create("ptmp-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1) {
+        perror("memfd_create");
+        exit(-1);
+    }
+    
+    if (ftruncate(local_ring_fd, sizeof(shm_ring_t)) == -1) {
+        perror("ftruncate");
+        exit(-1);
+    }
+    
+    fcntl(local_ring_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+    
+    local_ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, local_ring_fd, 0);
+    if (local_ring == MAP_FAILED) {
+        perror("mmap");
+        exit(-1);
+    }
+    
+    local_ring->node_id = node_id;
+    
+    int i;
+    for (i = 0; i < RING_MAX_CONSUMERS; i++)
+        ring_consumer_socks[i] = -1;
+}
+
+int ring_consumer_attached(uint32_t id) {
+    int i;
+    for (i = 0; i < RING_MAX_CONSUMERS; i++)
+        if (__atomic_load_n(&local_ring->consumers[i].active, __ATOMIC_ACQUIRE) &&
+            local_ring->consumers[i].node_id == id)
+            return 1;
+    
+    return 0;
+}
+
+void ring_detach(int slot) {
+    /* Stop publishing for a consumer that fell too far behind. Shutting its socket
+     * down wakes it, and the listener, which closes the slot. What it hasn't read
+     * yet is still in the ring, so it goes over its TCP link first; the dedupe
+     * window drops the record it may have been relaying as we detached.
+     * Called with client_list_mutex and ring_consumer_mutex held */
+    ring_consumer_t *consumer = &local_ring->consumers[slot];
+    __atomic_store_n(&consumer->active, 0, __ATOMIC_SEQ_CST);
+    shutdown(ring_consumer_socks[slot], SHUT_RDWR);
+    
+    int i;
+    for (i = 0; i < client_counter; i++)
+        if ((client_hot[i].flags & CLIENT_ACTIVE) && (client_hot[i].flags & CLIENT_PEER) &&
+            client_hot[i].sock_fd != -1 && client_data[i].peer_node_id == consumer->node_id)
+            break;
+    
+    uint64_t pos = __atomic_load_n(&consumer->read_pos, __ATOMIC_ACQUIRE);
+    uint32_t requeued = 0;
+    while (i < client_counter && pos < local_ring->write_pos) {
+        uint32_t offset = pos % RING_SIZE;
+        ring_record_t *record = (ring_record_t *) (local_ring->data + offset);
+        
+        if (record->len == RING_PADDING) {
+            pos += RING_SIZE - offset;
+            continue;
+        }
+        
+        /* It skips what it handed to us itself */
+        if (record->sender != consumer->node_id) {
+            queue_frame(i, LANE_CHAT, record->data, record->len);
+            requeued++;
+        }
+        
+        pos += (sizeof(ring_record_t) + record->len + 7) & ~7;
+    }
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Node %08x fell behind on the shared ring, sent %u messages over TCP",
+                    consumer->node_id, requeued);
+    pthread_mutex_unlock(&draw_mutex);
+}
+
+int ring_publish(const char *frame, uint32_t frame_len, uint32_t sender) {
+    /* Append one relay frame for every attached local node to read in place.
+     * Returns 0 if nobody is attached or the frame doesn't fit, so it goes over TCP.
+     * Only the transmit thread publishes, with client_list_mutex held, so it never
+     * waits for room: whoever still holds the ring full is detached on the spot */
+    uint32_t record_len = (sizeof(ring_record_t) + frame_len + 7) & ~7;
+    if (record_len > RING_SIZE / 2)
+        return 0;
+    
+    uint64_t pos = local_ring->write_pos;
+    uint32_t offset = pos % RING_SIZE;
+    uint64_t needed = record_len + (offset + record_len > RING_SIZE ? RING_SIZE - offset : 0);
+    int i, attached = 0, detached = 0;
+    
+    /* Consumers read in place, so whoever hasn't left room for this record is
+     * detached before anything of theirs is overwritten */
+    pthread_mutex_lock(&ring_consumer_mutex);
+    for (i = 0; i < RING_MAX_CONSUMERS; i++)
+        if (__atomic_load_n(&local_ring->consumers[i].active, __ATOMIC_ACQUIRE)) {
+            uint64_t read_pos = __atomic_load_n(&local_ring->consumers[i].read_pos, __ATOMIC_ACQUIRE);
+            if (pos + needed - read_pos > RING_SIZE) {
+                ring_detach(i);
+                detached = 1;
+            } else {
+                attached++;
+            }
+        }
+    pthread_mutex_unlock(&ring_consumer_mutex);
+    
+    /* A detached consumer checks its flag after copying a record, so it must
+     * see the flag cleared before it can see the record overwritten */
+    if (detached)
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    
+    if (attached == 0)
+        return 0;
+    
+    if (offset + record_len > RING_SIZE) {
+        /* Records never wrap: pad to the end and start over */
+        ((ring_record_t *) (local_ring->data + offset))->len = RING_PADDING;
+        pos += RING_SIZE - offset;
+        offset = 0;
+    }
+    
+    ring_record_t *record = (ring_record_t *) (local_ring->data + offset);
+    record->len = frame_len;
+    record->sender = sender;
+    memcpy(record->data, frame, frame_len);
+    
+    __atomic_store_n(&local_ring->write_pos, pos + record_len, __ATOMIC_SEQ_CST);
+    
+    /* Only consumers that went to sleep on an empty ring need a wakeup */
+    pthread_mutex_lock(&ring_consumer_mutex);
+    for (i = 0; i < RING_MAX_CONSUMERS; i++)
+        if (__atomic_load_n(&local_ring->consumers[i].active, __ATOMIC_ACQUIRE) &&
+            __atomic_load_n(&local_ring->consumers[i].sleeping, __ATOMIC_SEQ_CST))
+            eventfd_write(ring_event_fds[i], 1);
+    pthread_mutex_unlock(&ring_consumer_mutex);
+    
+    return 1;
+}
+
+void *ring_listener_thread(void *unused) {
+    /* Hand our ring to local nodes that ask for it, and notice when they go away.
+     * A consumer sends its node id and gets the memfd, an eventfd and its slot */
+    struct sockaddr_un address;
+    socklen_t address_len;
+    struct pollfd fds[RING_MAX_CONSUMERS + 1];
+    int slots[RING_MAX_CONSUMERS + 1];
+    int listen_fd, i;
+    
+    ring_socket_address(node_id, &address, &address_len);
+    
+    if ((listen_fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1 ||
+        bind(listen_fd, (struct sockaddr *) &address, address_len) == -1 ||
+        listen(listen_fd, RING_MAX_CONSUMERS) == -1) {
+        perror("ring socket");
+        return NULL;
+    }
+    
+    while (1) {
+        int count = 1;
+        fds[0].fd = listen_fd;
+        fds[0].events = POLLIN;
+        
+        for (i = 0; i < RING_MAX_CONSUMERS; i++)
+            if (ring_consumer_socks[i] != -1) {
+                fds[count].fd = ring_consumer_socks[i];
+                fds[count].events = POLLIN;
+                slots[count++] = i;
+            }
+        
+        poll(fds, count, -1);
+        
+        /* A consumer's socket only becomes readable when it closes, or when the
+         * publisher detached it */
+        for (i = 1; i < count; i++)
+            if (fds[i].revents) {
+                ring_consumer_t *consumer = &local_ring->consumers[slots[i]];
+                
+                pthread_mutex_lock(&ring_consumer_mutex);
+                __atomic_store_n(&consumer->active, 0, __ATOMIC_RELEASE);
+                close(ring_consumer_socks[slots[i]]);
+                close(ring_event_fds[slots[i]]);
+                ring_consumer_socks[slots[i]] = -1;
+                pthread_mutex_unlock(&ring_consumer_mutex);
+                
+                pthread_mutex_lock(&draw_mutex);
+                write_in_window("[info] Node %08x detached from the shared ring", consumer->node_id);
+                pthread_mutex_unlock(&draw_mutex);
+            }
+        
+        if (!(fds[0].revents & POLLIN))
+            continue;
+        
+        int sock_fd = accept(listen_fd, NULL, NULL);
+        uint32_t consumer_id;
+        if (sock_fd == -1)
+            continue;
+        
+        for (i = 0; i < RING_MAX_CONSUMERS; i++)
+            if (ring_consumer_socks[i] == -1)
+                break;
+        
+        if (i == RING_MAX_CONSUMERS || recv_all(sock_fd, (char *) &consumer_id, 4) == -1) {
+            close(sock_fd);
+            continue;
+        }
+        
+        ring_consumer_t *consumer = &local_ring->consumers[i];
+        consumer->node_id = consumer_id;
+        consumer->sleeping = 0;
+        __atomic_store_n(&consumer->read_pos, __atomic_load_n(&local_ring->write_pos, __ATOMIC_ACQUIRE), __ATOMIC_RELEASE);
+        ring_event_fds[i] = eventfd(0, EFD_CLOEXEC);
+        ring_consumer_socks[i] = sock_fd;
+        
+        /* The slot number travels as data, the two descriptors as SCM_RIGHTS */
+        char slot = i;
+        int passed_fds[2] = { local_ring_fd, ring_event_fds[i] };
+        char control[CMSG_SPACE(sizeof(passed_fds))];
+        struct iovec iov = { &slot, 1 };
+        struct msghdr msg;
+        
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(passed_fds));
+        memcpy(CMSG_DATA(cmsg), passed_fds, sizeof(passed_fds));
+        
+        if (sendmsg(sock_fd, &msg, 0) == -1) {
+            close(sock_fd);
+            close(ring_event_fds[i]);
+            ring_consumer_socks[i] = -1;
+            continue;
+        }
+        
+        __atomic_store_n(&consumer->active, 1, __ATOMIC_RELEASE);
+        
+        pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Node %08x attached to the shared ring", consumer_id);
+        pthread_mutex_unlock(&draw_mutex);
+    }
+}
+
+int ring_attach(uint32_t producer, int *sock_fd, shm_ring_t **ring, int *event_fd, int *slot) {
+    /* Map the ring of a node on this host; returns -1 if it isn't local */
+    struct sockaddr_un address;
+    socklen_t address_len;
+    
+    ring_socket_address(producer, &address, &address_len);
+    
+    *sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connect(*sock_fd, (struct sockaddr *) &address, address_len) == -1 ||
+        send(*sock_fd, &node_id, 4, 0) != 4) {
+        close(*sock_fd);
+        return -1;
+    }
+    
+    char slot_byte;
+    int passed_fds[2];
+    char control[CMSG_SPACE(sizeof(passed_fds))];
+    struct iovec iov = { &slot_byte, 1 };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr *cmsg;
+    if (recvmsg(*sock_fd, &msg, 0) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN(sizeof(passed_fds))) {
+        close(*sock_fd);
+        return -1;
+    }
+    
+    memcpy(passed_fds, CMSG_DATA(cmsg), sizeof(passed_fds));
+    
+    *ring = mmap(NULL, sizeof(shm_ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, passed_fds[0], 0);
+    close(passed_fds[0]);
+    
+    if (*ring == MAP_FAILED) {
+        close(passed_fds[1]);
+        close(*sock_fd);
+        return -1;
+    }
+    
+    *event_fd = passed_fds[1];
+    *slot = slot_byte;
+    
+    return 0;
+}
+
+void *ring_reader_thread(void *arg) {
+    /* Relay everything a local node publishes, copying each frame out of its ring.
+     * Sleeps on the eventfd only when the ring is empty */
+    uint32_t producer = *(uint32_t *) arg;
+    int sock_fd, event_fd, slot;
+    shm_ring_t *ring;
+    
+    free(arg);
+    
+    if (ring_attach(producer, &sock_fd, &ring, &event_fd, &slot) == 0) {
+        ring_consumer_t *consumer = &ring->consumers[slot];
+        
+        char *username;
+        asprintf(&username, "\x7fP%08x", producer);
+        
+        int id = add_client(-1, username, "", 1, 0, 0);
+        free(username);
+        if (id != -1) {
+            thread_data_t *data = &client_data[id];
+            data->peer_node_id = producer;
+            
+            pthread_mutex_lock(&draw_mutex);
+            write_in_window("[info] Reading node %08x through shared memory", producer);
+            pthread_mutex_unlock(&draw_mutex);
+            
+            uint64_t pos = consumer->read_pos;
+            struct pollfd fds[2] = { { event_fd, POLLIN, 0 }, { sock_fd, POLLIN, 0 } };
+            
+            while (1) {
+                /* The producer stopped waiting for us: its relay link takes over */
+                if (!__atomic_load_n(&consumer->active, __ATOMIC_ACQUIRE))
+                    break;
+                
+                if (pos == __atomic_load_n(&ring->write_pos, __ATOMIC_SEQ_CST)) {
+                    /* Announce we're going to sleep, then look again so a publish
+                     * in between can't be missed */
+                    __atomic_store_n(&consumer->sleeping, 1, __ATOMIC_SEQ_CST);
+                    
+                    if (pos == __atomic_load_n(&ring->write_pos, __ATOMIC_SEQ_CST)) {
+                        poll(fds, 2, -1);
+                        
+                        /* The producer closed our socket: it went away */
+                        if (fds[1].revents)
+                            break;
+                        
+                        eventfd_t value;
+                        eventfd_read(event_fd, &value);
+                    }
+                    
+                    __atomic_store_n(&consumer->sleeping, 0, __ATOMIC_SEQ_CST);
+                    continue;
+                }
+                
+                uint32_t offset = pos % RING_SIZE;
+                ring_record_t *record = (ring_record_t *) (ring->data + offset);
+                
+                uint32_t len = record->len, sender = record->sender;
+                
+                if (len == RING_PADDING) {
+                    pos += RING_SIZE - offset;
+                } else {
+                    /* Copy the record out, then make sure we were still attached, so
+                     * the producer can't have overwritten it under us */
+                    if (len > RING_SIZE - offset - sizeof(ring_record_t))
+                        break;
+                    
+                    char *frame = pool_alloc(len + 1);
+                    memcpy(frame, record->data, len);
+                    frame[len] = '\0';
+                    
+                    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+                    if (!__atomic_load_n(&consumer->active, __ATOMIC_RELAXED)) {
+                        pool_free(frame);
+                        break;
+                    }
+                    
+                    /* Skip what we handed to the producer ourselves */
+                    if (sender != node_id) {
+                        data->transmit_buffer = frame;
+                        data->transmit_len = len;
+                        data->trace_id = trace_sample();
+                        relay_transmit_buffer(data);
+                        
+                        pthread_mutex_lock(&draw_mutex);
+                        write_in_window("%s", data->transmit_buffer);
+                        pthread_mutex_unlock(&draw_mutex);
+                    }
+                    
+                    pool_free(frame);
+                    pos += (sizeof(ring_record_t) + len + 7) & ~7;
+                }
+                
+                __atomic_store_n(&consumer->read_pos, pos, __ATOMIC_RELEASE);
+            }
+            
+            pthread_mutex_lock(&client_list_mutex);
+            remove_client(id);
+            pthread_mutex_unlock(&client_list_mutex);
+        }
+        
+        pool_flush();
+        trace_release();
+        munmap(ring, sizeof(shm_ring_t));
+        close(event_fd);
+        close(sock_fd);
+    }
+    
+    pthread_mutex_lock(&members_mutex);
+    member_t *member = find_member(producer);
+    if (member)
+        member->ring_attached = 0;
+    pthread_mutex_unlock(&members_mutex);
+    
+    return NULL;
+}
+
+void attach_member_ring(member_t *member) {
+    /* Try to read a newly alive member through its shared ring; this quietly
+     * fails when it runs on another host. Called with members_mutex held */
+    if (member->ring_attached)
+        return;
+    
+    uint32_t *producer = malloc(sizeof(uint32_t));
+    *producer = member->node_id;
+    member->ring_attached = 1;
+    
+    pthread_t ring_handle;
+    pthread_create(&ring_handle, NULL, ring_reader_thread, (void *) producer);
+}
+#else
+void ring_init(void) {
+}
+
+int ring_consumer_attached(uint32_t id) {
+    return 0;
+}
+
+int ring_publish(const char *frame, uint32_t frame_len, uint32_t sender) {
+    return 0;
+}
+
+void attach_member_ring(member_t *member) {
+}
+#endif
+
+uint32_t hash_bytes(const void *data, size_t len, uint32_t hash) {
+    /* FNV-1a with a final mix, so nearby inputs land far apart on the ring */
+    const unsigned char *bytes = (const unsigned char *) data;
+    size_t i;
+    
+    for (i = 0; i < len; i++)
+        hash = (hash ^ bytes[i]) * 16777619;
+    
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    
+    return hash;
+}
+
+int compare_ring_points(const void *a, const void *b) {
+    const ring_point_t *first = (const ring_point_t *) a, *second = (const ring_point_t *) b;
+    
+    if (first->hash != second->hash)
+        return first->hash < second->hash ? -1 : 1;
+    return first->node_id < second->node_id ? -1 : first->node_id > second->node_id;
+}
+
+void rebuild_ring(void) {
+    /* Place RING_VNODES points per live node. A point only depends on its node's
+     * id, so a node joining or leaving moves about 1/N of the rooms */
+    ring_point_t *points = malloc(sizeof(ring));
+    uint32_t ids[MAX_NODES + 1];
+    struct sockaddr_in addresses[MAX_NODES + 1];
+    int count = 0, size = 0, i, j;
+    
+    memset(&addresses[count], 0, sizeof(struct sockaddr_in));
+    ids[count++] = node_id;
+    
+    /* Suspects keep their rooms until they are declared dead */
+    pthread_mutex_lock(&members_mutex);
+    for (i = 0; i < member_count; i++)
+        if (members[i].state != MEMBER_DEAD) {
+            addresses[count] = members[i].address;
+            ids[count++] = members[i].node_id;
+        }
+    pthread_mutex_unlock(&members_mutex);
+    
+    for (i = 0; i < count; i++)
+        for (j = 0; j < RING_VNODES; j++) {
+            uint32_t key[2] = { ids[i], j };
+            
+            points[size].hash = hash_bytes(key, sizeof(key), 2166136261u);
+            points[size].node_id = ids[i];
+            points[size].address = addresses[i];
+            size++;
+        }
+    
+    qsort(points, size, sizeof(ring_point_t), compare_ring_points);
+    
+    pthread_mutex_lock(&ring_mutex);
+    memcpy(ring, points, size * sizeof(ring_point_t));
+    ring_size = size;
+    pthread_mutex_unlock(&ring_mutex);
+    
+    free(points);
+}
+
+uint32_t room_owner(const char *room, struct sockaddr_in *address) {
+    /* The node owning the first point at or after the room's hash, wrapping around */
+    uint32_t hash = hash_bytes(room, strlen(room), 2166136261u), owner = node_id;
+    
+    pthread_mutex_lock(&ring_mutex);
+    if (ring_size > 0) {
+        int low = 0, high = ring_size;
+        while (low < high) {
+            int middle = (low + high) / 2;
+            if (ring[middle].hash < hash)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        
+        ring_point_t *point = &ring[low == ring_size ? 0 : low];
+        owner = point->node_id;
+        if (address)
+            *address = point->address;
+    }
+    pthread_mutex_unlock(&ring_mutex);
+    
+    return owner;
+}
+
+int owns_room(const char *room) {
+    return room[0] == '\0' || room_owner(room, NULL) == node_id;
+}
+
+char *format_redirect(struct sockaddr_in *address) {
+    /* 0x7F 'R' followed by host:port of the node the client should use instead */
+    char *redirect;
+    asprintf(&redirect, "\x7fR%s:%u", inet_ntoa(address->sin_addr), ntohs(address->sin_port));
+    
+    return redirect;
+}
+
+void send_notice(int sock_fd, int packet, const char *text) {
+    /* For connections that have no writer thread yet */
+    if (packet)
+        send_packet(sock_fd, text, strlen(text) + 1);
+    else
+        send_message(sock_fd, text);
+}
+
+char *recv_handshake(int sock_fd, int packet, uint32_t *len) {
+    /* The first frame of a new connection, or NULL */
+    if (!packet)
+        return process_frame(sock_fd, len);
+    
+    char *frame = (char *) pool_alloc(MAX_FRAME_SIZE + 1);
+    int frame_len = recv_packet(sock_fd, frame, MAX_FRAME_SIZE, 0);
+    if (frame_len <= 0) {
+        pool_free(frame);
+        return NULL;
+    }
+    
+    frame[frame_len] = '\0';
+    *len = frame_len;
+    return frame;
+}
+
+void send_redirect(int sock_fd, int packet, struct sockaddr_in *address) {
+    char *redirect = format_redirect(address);
+    
+    send_notice(sock_fd, packet, redirect);
+    
+    free(redirect);
+}
+
+void redirect_moved_clients(void) {
+    /* After the ring changed, send clients of rooms that moved to their new owner.
+     * The writer shuts the socket down once the redirect is out, and the client
+     * thread cleans up as usual */
+    struct sockaddr_in address;
+    int i, moved = 0;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    for (i = 0; i < client_counter; i++)
+        if ((client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER)) == CLIENT_ACTIVE &&
+            interned_string(client_hot[i].room)[0] != '\0' &&
+            room_owner(interned_string(client_hot[i].room), &address) != node_id) {
+            char *redirect = format_redirect(&address);
+            queue_message(i, LANE_CONTROL, redirect);
+            client_data[i].close_when_drained = 1;
+            free(redirect);
+            moved++;
+        }
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    if (moved > 0) {
+        pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Redirected %d clients to their room's new node", moved);
+        pthread_mutex_unlock(&draw_mutex);
+    }
+}
+
+void park_client_thread(thread_data_t *data) {
+    /* A client thread's work is over once the restart has stopped it */
+    pthread_mutex_lock(&client_list_mutex);
+    data->parked = 1;
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    while (1)
+        pause();
+}
+
+#ifdef __linux__
+/* Hot restart: a new server process started with $CHAT_TAKEOVER connects to the
+ * running one's restart socket and gets the listening socket and every client's
+ * socket as SCM_RIGHTS, then the state that goes with them as frames:
+ *   <last seq>:<boot id>
+ *   <seq>\0<username>\0<room>\0<data>   for each history entry, then an empty frame
+ *   <username>\0<room>\0<close when drained>\0<partial frame>   for each client,
+ *   followed by <lane digit><frame> for each frame queued to it, then an empty frame
+ * The partial frame is what the client thread had read of the next frame: part of
+ * its header, or all of it and part of the body.
+ * The old process exits once it has sent everything. Peer links and shared rings
+ * aren't handed over; the new process joins the mesh as a new node, and multicast
+ * listeners start over with its 0x7F 'M' */
+void restart_socket_address(const char *port, struct sockaddr_un *address, socklen_t *address_len) {
+    /* Abstract socket named after the chat port */
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    int name_len = snprintf(address->sun_path + 1, sizeof(address->sun_path) - 1, "ptmp-restart-%s", port);
+    *address_len = offsetof(struct sockaddr_un, sun_path) + 1 + name_len;
+}
+
+void restart_listen(const char *port) {
+    /* Be ready to hand over to the next process. Without the socket, this server
+     * can only be restarted the old way */
+    struct sockaddr_un address;
+    socklen_t address_len;
+    
+    restart_socket_address(port, &address, &address_len);
+    
+    if ((restart_listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1 ||
+        bind(restart_listen_fd, (struct sockaddr *) &address, address_len) == -1 ||
+        listen(restart_listen_fd, 1) == -1) {
+        write_in_window("[info] No hot restart: %s", strerror(errno));
+        if (restart_listen_fd != -1)
+            close(restart_listen_fd);
+        restart_listen_fd = -1;
+    }
+}
+
+void interrupt_wait(int signum) {
+    /* Only here to wake client threads out of ppoll */
+}
+
+void hand_off(int restart_fd, int listen_fd) {
+    /* Give our listening socket and clients to the process on restart_fd, then exit.
+     * Client threads stop at the next read and writers after the frame they are on,
+     * so that every byte is read and written exactly once, by one process or the
+     * other. Runs on the accepting thread, so no connection is half accepted */
+    int slots[MAX_CLIENTS], passed_fds[MAX_CLIENTS + 1], count = 0, left_behind = 0, waiting = 1, i;
+    uint32_t generations[MAX_CLIENTS];
+    long long deadline = now_us() + RESTART_TIMEOUT * 1000000LL;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    restarting = 1;
+    for (i = 0; i < client_counter; i++)
+        if ((client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER)) == CLIENT_ACTIVE && client_hot[i].sock_fd != -1) {
+            slots[count] = i;
+            generations[count++] = client_data[i].generation;
+            pthread_kill(client_threads[i], SIGUSR2);
+        }
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    /* Streams and attachments are let through to their end, if it comes in time */
+    while (waiting && now_us() < deadline) {
+        usleep(1000);
+        waiting = 0;
+        
+        pthread_mutex_lock(&client_list_mutex);
+        for (i = 0; i < count; i++)
+            if (client_data[slots[i]].generation == generations[i] && !client_data[slots[i]].parked)
+                waiting = 1;
+        pthread_mutex_unlock(&client_list_mutex);
+    }
+    
+    /* Leave out clients that went away meanwhile or are still busy, and stop the
+     * writers of the others */
+    int kept = 0;
+    pthread_mutex_lock(&client_list_mutex);
+    for (i = 0; i < count; i++)
+        if (client_data[slots[i]].generation != generations[i]) {
+            continue;
+        } else if (!client_data[slots[i]].parked) {
+            shutdown(client_hot[slots[i]].sock_fd, SHUT_RDWR);
+            left_behind++;
+        } else {
+            slots[kept++] = slots[i];
+            client_data[slots[i]].generation++;
+            pthread_cond_signal(&client_hot[slots[i]].queue->cond);
+        }
+    count = kept;
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    for (i = 0; i < count; i++)
+        pthread_join(client_data[slots[i]].writer, NULL);
+    
+    /* Wait out streams still writing to our clients, including the padding of any cut
+     * short above; the locks are kept until we exit */
+    lock_writers(slots, count, 1);
+    
+    /* The client count travels as data, the descriptors as SCM_RIGHTS */
+    char client_count = count;
+    char control[CMSG_SPACE(sizeof(passed_fds))];
+    struct iovec iov = { &client_count, 1 };
+    struct msghdr msg;
+    
+    passed_fds[0] = listen_fd;
+    for (i = 0; i < count; i++)
+        passed_fds[i + 1] = client_data[slots[i]].sock_fd;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = CMSG_SPACE((count + 1) * sizeof(int));
+    
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN((count + 1) * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), passed_fds, (count + 1) * sizeof(int));
+    
+    if (sendmsg(restart_fd, &msg, 0) == -1) {
+        perror("hot restart");
+        exit(-1);
+    }
+    
+    /* The transmit, ring and gossip threads run until we exit, so the history and
+     * the queues are read under client_list_mutex, which is never released */
+    char *frame;
+    uint32_t seq;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    asprintf(&frame, "%u:%08x", last_seq, boot_id);
+    send_message(restart_fd, frame);
+    free(frame);
+    
+    for (seq = last_seq >= HISTORY_SIZE ? last_seq - HISTORY_SIZE + 1 : 1; seq <= last_seq; seq++) {
+        history_entry_t *entry = &history[seq % HISTORY_SIZE];
+        if (entry->seq != seq)
+            continue;
+        
+        int frame_len = asprintf(&frame, "%u%c%s%c%s%c%s", seq, 0, interned_string(entry->username), 0,
+                                 interned_string(entry->room), 0, entry->data);
+        send_frame(restart_fd, frame, frame_len + 1);
+        free(frame);
+    }
+    send_frame(restart_fd, "", 0);
+    
+    for (i = 0; i < count; i++) {
+        thread_data_t *client = &client_data[slots[i]];
+        int lane;
+        
+        int frame_len = asprintf(&frame, "%s%c%s%c%d%c", interned_string(client->username), 0,
+                                 interned_string(client_hot[slots[i]].room), 0, client->close_when_drained, 0);
+        
+        /* A body being read goes with its header, which recv_client_header has consumed */
+        if (client->in_body) {
+            frame = realloc(frame, frame_len + LEN_FIELD_SIZE + client->body_len);
+            pack_32i(client->body_size + LEN_FIELD_SIZE, frame + frame_len);
+            memcpy(frame + frame_len + LEN_FIELD_SIZE, client->transmit_buffer, client->body_len);
+            frame_len += LEN_FIELD_SIZE + client->body_len;
+        } else {
+            frame = realloc(frame, frame_len + client->header_len);
+            memcpy(frame + frame_len, client->header, client->header_len);
+            frame_len += client->header_len;
+        }
+        send_frame(restart_fd, frame, frame_len);
+        free(frame);
+        
+        for (lane = 0; lane < LANE_COUNT; lane++) {
+            queued_frame_t *queued;
+            for (queued = client_hot[slots[i]].queue->lanes[lane].head; queued; queued = queued->next) {
+                /* The lane digit takes the place of the length field */
+                queued->data[LEN_FIELD_SIZE - 1] = '0' + lane;
+                send_frame(restart_fd, queued->data + LEN_FIELD_SIZE - 1, queued->len - LEN_FIELD_SIZE + 1);
+            }
+        }
+        send_frame(restart_fd, "", 0);
+    }
+    
+    /* Free our ports before the new process goes for them; it waits for this
+     * connection to close */
+    close(gossip_fd);
+    close(restart_listen_fd);
+    endwin();
+    close(restart_fd);
+    
+    if (left_behind > 0)
+        printf("Left behind %d clients still busy with a stream or attachment\n", left_behind);
+    printf("Handed over to the new process\n");
+    exit(0);
+}
+
+char *recv_state_frame(int restart_fd, uint32_t *len) {
+    /* Next frame of a hand-off; an empty one ends a list */
+    if (recv_frame_header(restart_fd, len) == -1)
+        return NULL;
+    
+    return recv_frame_body(restart_fd, *len);
+}
+
+int restart_connect(const char *port, int *listen_fd, int *client_fds, int *count) {
+    /* Ask the running server to hand over; returns the connection to read the state
+     * from, or -1 if no server is running on port */
+    struct sockaddr_un address;
+    socklen_t address_len;
+    
+    restart_socket_address(port, &address, &address_len);
+    
+    int restart_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (connect(restart_fd, (struct sockaddr *) &address, address_len) == -1) {
+        close(restart_fd);
+        return -1;
+    }
+    
+    char client_count;
+    int passed_fds[MAX_CLIENTS + 1];
+    char control[CMSG_SPACE(sizeof(passed_fds))];
+    struct iovec iov = { &client_count, 1 };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    
+    struct cmsghdr *cmsg;
+    if (recvmsg(restart_fd, &msg, MSG_CMSG_CLOEXEC) != 1 || (cmsg = CMSG_FIRSTHDR(&msg)) == NULL ||
+        cmsg->cmsg_type != SCM_RIGHTS || cmsg->cmsg_len != CMSG_LEN((client_count + 1) * sizeof(int))) {
+        close(restart_fd);
+        return -1;
+    }
+    
+    memcpy(passed_fds, CMSG_DATA(cmsg), (client_count + 1) * sizeof(int));
     
-    /* Allocate msg buffer and set the length */
-    msg = (char *) malloc(msg_len);
-    pack_32i(msg_len, msg);
+    /* Accepted sockets don't inherit close-on-exec, so clear what recvmsg set */
+    *listen_fd = passed_fds[0];
+    *count = client_count;
+    memcpy(client_fds, passed_fds + 1, client_count * sizeof(int));
     
-    /* Copy data to msg buffer */
-    memcpy(msg + LEN_FIELD_SIZE, data, data_len);
+    int i;
+    for (i = 0; i <= client_count; i++)
+        fcntl(passed_fds[i], F_SETFD, 0);
     
-    /* Write data to wire */
-    int bytes_written = 0, bytes_left = msg_len - bytes_written, total = 0;
-    while (bytes_left > 0) {
-        bytes_written = send(sock_fd, msg + total, bytes_left, 0);
-        bytes_left -= bytes_written;
-        total += bytes_left;
-    }
+    return restart_fd;
 }
 
-char *process_message(int sock_fd) {
-    /* Message structure:
-     * <length> <data>
-     * Length includes all of the other fields and itself. It is a 32-bit integer.
-     * Data is the data. Ignored if type == 1.
-     */
-    
-    /* Working buffer */
-    char *sock_buf = (char *) malloc(1024);
+void take_over_clients(int restart_fd, int *client_fds, int count) {
+    /* Rebuild what hand_off sent and start serving the clients. Everything queued
+     * to them goes back into the queues before any new message can get there */
+    char *frame, *field;
+    uint32_t len;
+    int ids[MAX_CLIENTS], i;
     
-    /* Another buffer we'll use later for the data field */
-    char *data_buf;
-    
-    /* Start by receiving LEN_FIELD_SIZE bytes to get the next message length */
-    memset(sock_buf, 0, 1024);
-    if (recv(sock_fd, sock_buf, LEN_FIELD_SIZE, 0) == 0) {
-        write_in_window("[info] Connection closed\n");
-        exit(0);
+    if ((frame = recv_state_frame(restart_fd, &len)) == NULL) {
+        perror("hot restart");
+        exit(-1);
     }
     
-    /* Unpack length */
-    uint32_t msg_len = unpack_32i(sock_buf);
-    uint32_t data_len = msg_len - LEN_FIELD_SIZE; /* Substract 4 bytes to get the data length */
+    pthread_mutex_lock(&client_list_mutex);
+    last_seq = (uint32_t) strtoul(frame, &field, 10);
+    if (*field == ':')
+        boot_id = (uint32_t) strtoul(field + 1, NULL, 16);
+    pool_free(frame);
     
-    /* Allocate another buffer for the message, take NUL into account */
-    data_buf = (char *) malloc(data_len + 1);
-    /* Various counters */
-    int bytes_read = 0, bytes_left = data_len - bytes_read, total = 0;
+    while ((frame = recv_state_frame(restart_fd, &len)) != NULL && len > 0) {
+        uint32_t seq = (uint32_t) strtoul(frame, &field, 10);
+        uint16_t username = intern(field + 1);
+        field += strlen(field + 1) + 2;
+        uint16_t room = intern(field);
+        
+        record_history(seq, 0, username, room, field + strlen(field) + 1);
+        intern_release(username);
+        intern_release(room);
+        pool_free(frame);
+    }
+    pthread_mutex_unlock(&client_list_mutex);
     
-    while (bytes_left > 0) {
-        bytes_read = recv(sock_fd, sock_buf, 1024, 0);
+    for (i = 0; i < count && frame != NULL; i++) {
+        pool_free(frame);
+        if ((frame = recv_state_frame(restart_fd, &len)) == NULL)
+            break;
         
-        memcpy(data_buf + total, sock_buf, bytes_read);
+        char *room = frame + strlen(frame) + 1;
+        char *close_when_drained = room + strlen(room) + 1;
+        char *header = close_when_drained + strlen(close_when_drained) + 1;
         
-        bytes_left -= bytes_read;
-        total += bytes_read;
+        ids[i] = add_client(client_fds[i], frame, room, 0, 0, 0);
+        
+        pthread_mutex_lock(&client_list_mutex);
+        if (ids[i] != -1) {
+            thread_data_t *client = &client_data[ids[i]];
+            uint32_t partial_len = frame + len - header;
+            
+            client->close_when_drained = atoi(close_when_drained);
+            
+            /* A whole header means part of the body came too; the client thread starts
+             * with the rest of that */
+            if (partial_len < LEN_FIELD_SIZE) {
+                client->header_len = partial_len;
+                memcpy(client->header, header, partial_len);
+            } else {
+                client->header_len = LEN_FIELD_SIZE;
+                memcpy(client->header, header, LEN_FIELD_SIZE);
+                client->body_size = unpack_32i(header) - LEN_FIELD_SIZE;
+                client->body_len = partial_len - LEN_FIELD_SIZE;
+                client->transmit_buffer = (char *) pool_alloc(client->body_size + 1);
+                memcpy(client->transmit_buffer, header + LEN_FIELD_SIZE, client->body_len);
+                client->in_body = 1;
+            }
+        }
+        
+        pool_free(frame);
+        while ((frame = recv_state_frame(restart_fd, &len)) != NULL && len > 0) {
+            if (ids[i] != -1)
+                queue_frame(ids[i], frame[0] - '0', frame + 1, len - 1);
+            pool_free(frame);
+        }
+        pthread_mutex_unlock(&client_list_mutex);
     }
     
-    /* Add NUL-terminator */
-    data_buf[total] = '\0';
+    if (frame == NULL) {
+        perror("hot restart");
+        exit(-1);
+    }
+    pool_free(frame);
     
-    /* Free socket buffer */
-    free(sock_buf);
+    for (i = 0; i < count; i++)
+        if (ids[i] != -1)
+            client_threads[ids[i]] = spawn_client_thread(&client_data[ids[i]]);
+        else
+            close(client_fds[i]);
     
-    return data_buf;
+    /* The old process closes its end as it exits */
+    char byte;
+    while (recv(restart_fd, &byte, 1, 0) > 0)
+        ;
+    close(restart_fd);
+    
+    write_in_window("[info] Took over %d clients", count);
+}
+#else
+void restart_listen(const char *port) {
 }
 
+void hand_off(int restart_fd, int listen_fd) {
+}
+
+int restart_connect(const char *port, int *listen_fd, int *client_fds, int *count) {
+    /* Hot restarts need abstract sockets */
+    errno = ENOTSUP;
+    return -1;
+}
+
+void take_over_clients(int restart_fd, int *client_fds, int count) {
+}
+#endif
+
 void *broadcast_listener(void *arg) {
     broadcast_data_t *broadcast_data = (broadcast_data_t *) arg;
     
@@ -171,97 +3217,247 @@ void *broadcast_listener(void *arg) {
     
     bind(sockfd, result->ai_addr, result->ai_addrlen);
     
+    /* Gossip joins go to the LAN broadcast address */
+    int value = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &value, sizeof(int));
+    gossip_fd = sockfd;
+    
     struct sockaddr_in sender_address;
-    socklen_t addr_len = sizeof(sender_address);
+    socklen_t addr_len;
+    
+    char *buf = malloc(1500);
+    struct pollfd pfd = { sockfd, POLLIN, 0 };
+    
+    gossip_join(broadcast_data);
     
     while (1) {
-        /* Allocate two bytes for 0x7F 0x7F */
-        char *buf = malloc(2);
+        /* Wake up in time for the next step of the failure detector */
+        int timeout = (int) (next_probe_ms - now_ms());
+        if (probe_target && !probe_acked && !probe_indirect_sent)
+            timeout = (int) (probe_started_ms + PING_TIMEOUT_MS - now_ms());
+        
+        if (poll(&pfd, 1, timeout < 0 ? 0 : timeout) > 0) {
+            addr_len = sizeof(sender_address);
+            int bytes_received = recvfrom(sockfd, buf, 1500, 0, (struct sockaddr *) &sender_address, &addr_len);
+            
+            /* 0x7F 0x7F is a client looking for rooms, 0x7F 'G' is gossip between servers */
+            if (bytes_received >= 2 && buf[0] == '\x7f' && buf[1] == '\x7f')
+                sendto(sockfd, padded_room_name, 32, 0, (struct sockaddr *) &sender_address, addr_len);
+            else if (bytes_received >= 2 && buf[0] == '\x7f' && buf[1] == 'G')
+                handle_gossip(buf, bytes_received, &sender_address);
+        }
+        
+        gossip_tick(broadcast_data);
         
-        /* Read two bytes from socket */
-        int bytes_received = recvfrom(sockfd, buf, 2, 0, &sender_address, &addr_len);
+        if (now_ms() >= next_filter_check_ms) {
+            next_filter_check_ms = now_ms() + FILTER_CHECK_MS;
+            reload_filter();
+        }
         
-        /* Check that the two bytes are indeed 0x7F 0x7F */
-        if (buf[0] == '\x7f' && buf[1] == '\x7f')
-            sendto(sockfd, padded_room_name, 32, 0, (struct sockaddr *) &sender_address, addr_len);
+        if (multicast_fd != -1 && now_ms() >= next_heartbeat_ms) {
+            next_heartbeat_ms = now_ms() + MULTICAST_HEARTBEAT_MS;
+            multicast_heartbeat();
+        }
         
-        free(buf);
+        if (ring_dirty) {
+            ring_dirty = 0;
+            rebuild_ring();
+            redirect_moved_clients();
+        }
+        
+        if (trace_dump_requested) {
+            trace_dump_requested = 0;
+            dump_trace();
+        }
     }
 }
 
-void start_server_loop(const char *port, const char *room_name) {
-    struct sockaddr_in local_address, remote_address;
+void start_server_loop(const char *port, const char *room_name, const char **peers, int peer_count) {
+    struct sockaddr_in remote_address;
     socklen_t remote_address_size;
     
-    int sock_fd, new_sock_fd;
+    int sock_fd, new_sock_fd, seed;
     
-    /* Specify socket parameters */
-    local_address.sin_family = AF_INET;
-    local_address.sin_port = htons(atoi(port));
-    local_address.sin_addr.s_addr = INADDR_ANY;
+    /* gossip_join splits the seeds at the colon, at start and on every rejoin */
+    for (seed = 0; seed < peer_count; seed++)
+        if (strrchr(peers[seed], ':') == NULL) {
+            fprintf(stderr, "Seed %s should be <host>:<port>\n", peers[seed]);
+            exit(-1);
+        }
     
-    /* Create a TCP socket */
-    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
+    /* A hot restart takes the running server's listening socket and clients over */
+    int restart_fd = -1, client_fds[MAX_CLIENTS], client_count = 0;
+    if (getenv("CHAT_TAKEOVER") != NULL &&
+        (restart_fd = restart_connect(port, &sock_fd, client_fds, &client_count)) == -1) {
+        perror("hot restart");
         exit(-1);
     }
     
-    /* Allow socket reusing */
-    int value = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(int)) == -1) {
-        perror("setsockopt");
+    if (restart_fd == -1 && (sock_fd = transport_listen(port)) == -1) {
+        perror("listen");
         exit(-1);
     }
     
-    /* Bind the socket */
-    if (bind(sock_fd, (struct sockaddr *) &local_address, sizeof(local_address)) == -1) {
-        perror("bind");
-        exit(-1);
-    }
+    write_in_window("[info] Started listening");
     
-    /* Start listening */
-    if (listen(sock_fd, 2) == -1) {
-        perror("listen");
-        exit(-1);
+    /* Accepted sockets inherit the busy-poll time. Raising it past
+     * net.core.busy_read takes CAP_NET_ADMIN; the threads spin regardless */
+#ifdef SO_BUSY_POLL
+    int busy_poll = (int) busy_poll_us;
+    if (busy_poll_us && setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll, sizeof(busy_poll)) == -1)
+        write_in_window("[info] No socket busy polling: %s", strerror(errno));
+#endif
+    
+    /* Have the filter in place before the first message */
+    reload_filter();
+    
+    if (getenv("CHAT_MULTICAST") != NULL) {
+        multicast_init(getenv("CHAT_MULTICAST"), getenv("CHAT_MULTICAST_IF"));
+        write_in_window("[info] Publishing room chat to %s", getenv("CHAT_MULTICAST"));
     }
     
-    write_in_window("[info] Started listening");
+    int i;
+    for (i = 0; i < MAX_CLIENTS; i++) {
+        client_hot[i].queue = &client_queues[i];
+        pthread_cond_init(&client_queues[i].cond, NULL);
+        pthread_mutex_init(&client_data[i].write_mutex, NULL);
+    }
+    client_counter = 0;
     
     pthread_t transmit_handle;
     pthread_create(&transmit_handle, NULL, transmit_thread, NULL);
+    if (pinned_cpu_count > 0)
+        pin_thread(transmit_handle, pinned_cpus[0]);
+    
+    pthread_t presence_handle;
+    pthread_create(&presence_handle, NULL, presence_thread, NULL);
+    
+    /* Before anything else can relay to them */
+    if (restart_fd != -1)
+        take_over_clients(restart_fd, client_fds, client_count);
+    restart_listen(port);
+    
+    /* After a hot restart, the old process is gone by now and the path is ours */
+    int local_fd = -1;
+    const char *local_path = getenv("CHAT_LOCAL_SOCKET");
+    if (local_path != NULL && (local_fd = transport_listen_local(local_path)) == -1) {
+        perror("local socket");
+        exit(-1);
+    }
+    
+    ring_init();
     
-    broadcast_data_t *broadcast_data = malloc(sizeof(broadcast_data));
+#ifdef __linux__
+    pthread_t ring_handle;
+    pthread_create(&ring_handle, NULL, ring_listener_thread, NULL);
+#endif
+    
+    /* Gossip finds the other servers of the cluster on the LAN and through the
+     * seed peers, and the mesh links are made as members show up */
+    chat_port = atoi(port);
+    
+    broadcast_data_t *broadcast_data = malloc(sizeof(broadcast_data_t));
     broadcast_data->port = port;
     broadcast_data->room_name = room_name;
+    broadcast_data->peers = peers;
+    broadcast_data->peer_count = peer_count;
     
     pthread_t broadcast_handle;
     pthread_create(&broadcast_handle, NULL, broadcast_listener, (void *) broadcast_data);
     
-    client_counter = 0;
-    
     /* Connection handling loop */
-    while (client_counter < MAX_CLIENTS) {
+    while (1) {
+        /* The next server process may be asking to take over, and local clients
+         * have a socket of their own */
+        int packet = 0;
+        if (restart_listen_fd != -1 || local_fd != -1) {
+            struct pollfd fds[3] = { { sock_fd, POLLIN, 0 }, { restart_listen_fd, POLLIN, 0 }, { local_fd, POLLIN, 0 } };
+            poll(fds, 3, -1);
+            
+            if ((fds[1].revents & POLLIN) && (restart_fd = accept(restart_listen_fd, NULL, NULL)) != -1)
+                hand_off(restart_fd, sock_fd);
+            
+            packet = (fds[2].revents & POLLIN) != 0;
+            if (!packet && !(fds[0].revents & POLLIN))
+                continue;
+        }
+        
         remote_address_size = sizeof(remote_address);
-        client_data[client_counter].sock_fd = accept(sock_fd, (struct sockaddr *) &remote_address, &remote_address_size);
+        if (packet)
+            new_sock_fd = accept(local_fd, NULL, NULL);
+        else
+            new_sock_fd = accept(sock_fd, (struct sockaddr *) &remote_address, &remote_address_size);
         
-        /* Accept the username message */
-        client_data[client_counter].username = process_message(client_data[client_counter].sock_fd);
-        client_data[client_counter].client_id = client_counter;
+        /* Accept the username message. A reconnecting client appends the last
+         * sequence number it has seen after the username's NUL, as <seq>:<boot id>
+         * if it knows which run of the server that was, and a client asking for a
+         * room appends the room after that */
+        uint32_t handshake_len, resume_seq = 0, resume_boot = 0;
+        char *username = recv_handshake(new_sock_fd, packet, &handshake_len);
+        if (username == NULL) {
+            close(new_sock_fd);
+            continue;
+        }
         
-        write_in_window("[info] Received connection");
+        char *room = "";
+        char *trailer = username + strlen(username) + 1;
+        if (handshake_len > trailer - username) {
+            char *boot;
+            resume_seq = (uint32_t) strtoul(trailer, &boot, 10);
+            if (*boot == ':')
+                resume_boot = (uint32_t) strtoul(boot + 1, NULL, 16);
+            
+            if (handshake_len > trailer + strlen(trailer) + 1 - username) {
+                room = trailer + strlen(trailer) + 1;
+                sanitize_text(room, strlen(room), 1);
+            }
+        }
         
-        /* Lock the list and counter so the transmit thread does not use them concurrently */
-        pthread_mutex_lock(&client_list_mutex);
-        client_threads[client_counter] = spawn_client_thread(&client_data[client_counter]);
-        client_counter++;
-        pthread_mutex_unlock(&client_list_mutex);
+        /* Rooms live on a single node; send the client there */
+        struct sockaddr_in owner_address;
+        if (room[0] != '\0' && room_owner(room, &owner_address) != node_id) {
+            send_redirect(new_sock_fd, packet, &owner_address);
+            close(new_sock_fd);
+            
+            pthread_mutex_lock(&draw_mutex);
+            write_in_window("[info] Redirected a client for room %s", room);
+            pthread_mutex_unlock(&draw_mutex);
+            
+            pool_free(username);
+            continue;
+        }
+        
+        /* Other servers of the mesh introduce themselves with 0x7F 'P' */
+        int is_peer = !packet && username[0] == '\x7f' && username[1] == 'P';
+        if (!is_peer)
+            sanitize_text(username, strlen(username), 1);
+        
+        int id = add_client(new_sock_fd, username, room, is_peer, is_peer ? 0 : resume_seq, resume_boot);
+        if (id == -1) {
+            /* Max amount of clients reached */
+            send_notice(new_sock_fd, packet, "Too many clients!");
+            close(new_sock_fd);
+            pool_free(username);
+            continue;
+        }
+        
+        if (is_peer)
+            client_data[id].peer_node_id = (uint32_t) strtoul(username + 2, NULL, 16);
+        
+        client_threads[id] = spawn_client_thread(&client_data[id]);
+        
+        pthread_mutex_lock(&draw_mutex);
+        if (is_peer)
+            write_in_window("[info] Peer %s linked", username + 2);
+        else if (resume_seq > 0)
+            write_in_window("[info] Resumed connection after message %u", resume_seq);
+        else
+            write_in_window("[info] Received connection");
+        pthread_mutex_unlock(&draw_mutex);
+        
+        pool_free(username);
     }
     
-    /* Wait for threads to finish */
-    int i;
-    for (int i = 0; i < MAX_CLIENTS; i++)
-        pthread_join(client_threads[i], NULL);
-    
     /* Close listening socket */
     close(sock_fd);
 }
@@ -292,58 +3488,734 @@ void write_in_window(const char *message, ...) {
     wrefresh(stdscr);
 }
 
+void send_private_message(int from, const char *request) {
+    /* request is "<username> <text>"; only that client gets the text, along with
+     * who sent it. Called with client_list_mutex held */
+    const char *text = strchr(request, ' ');
+    int name = text == NULL ? -1 : intern_lookup(request, text - request);
+    
+    if (name == -1 || interned[name].client == 0) {
+        queue_message(from, LANE_CONTROL, "[info] No such user on this server");
+        return;
+    }
+    
+    const char *sender = interned_string(client_data[from].username);
+    size_t len = strlen(sender) + strlen(interned_string(name)) + strlen(text) + 7;
+    char *message = (char *) pool_alloc(len);
+    
+    snprintf(message, len, "[%s -> %s] %s", sender, interned_string(name), text + 1);
+    queue_message(interned[name].client - 1, LANE_DIRECT, message);
+    pool_free(message);
+}
+
+size_t append_names(char *buffer, size_t len, uint16_t room, int flags, int mask, const char *prefix) {
+    /* Append "\n<prefix><name>" for each client in room whose flags under mask
+     * equal flags, and return the new length. With buffer NULL, only count.
+     * Called with client_list_mutex held */
+    int i;
+    
+    for (i = 0; i < client_counter; i++)
+        if (client_hot[i].room == room && (client_hot[i].flags & mask) == flags) {
+            const char *name = interned_string(client_data[i].username);
+            if (buffer != NULL)
+                sprintf(buffer + len, "\n%s%s", prefix, name);
+            len += 1 + strlen(prefix) + strlen(name);
+        }
+    
+    return len;
+}
+
+void flush_presence(void) {
+    /* Send each room with joins or leaves its delta, and its newcomers the whole
+     * roster. Called with client_list_mutex held */
+    uint16_t rooms[2 * MAX_CLIENTS];
+    int room_count = 0, i, j;
+    
+    for (i = 0; i < presence_leave_count; i++) {
+        for (j = 0; j < room_count && rooms[j] != presence_leaves[i].room; j++)
+            ;
+        if (j == room_count)
+            rooms[room_count++] = presence_leaves[i].room;
+    }
+    
+    for (i = 0; i < client_counter; i++) {
+        if ((client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER | CLIENT_LISTED)) != CLIENT_ACTIVE)
+            continue;
+        
+        for (j = 0; j < room_count && rooms[j] != client_hot[i].room; j++)
+            ;
+        if (j == room_count)
+            rooms[room_count++] = client_hot[i].room;
+    }
+    
+    for (j = 0; j < room_count; j++) {
+        uint16_t room = rooms[j];
+        uint32_t from = interned[room].version, to = ++interned[room].version;
+        int joined = CLIENT_ACTIVE, listed = CLIENT_ACTIVE | CLIENT_LISTED;
+        int mask = CLIENT_ACTIVE | CLIENT_PEER | CLIENT_LISTED;
+        
+        /* Leaves first: someone reconnecting within the batch leaves, then joins */
+        size_t len = 32 + append_names(NULL, 0, room, joined, mask, "+");
+        for (i = 0; i < presence_leave_count; i++)
+            if (presence_leaves[i].room == room)
+                len += 2 + strlen(interned_string(presence_leaves[i].username));
+        
+        char *delta = (char *) pool_alloc(len);
+        len = sprintf(delta, "\x7f" "U%u:%u", from, to);
+        for (i = 0; i < presence_leave_count; i++)
+            if (presence_leaves[i].room == room)
+                len += sprintf(delta + len, "\n-%s", interned_string(presence_leaves[i].username));
+        append_names(delta, len, room, joined, mask, "+");
+        
+        /* Newcomers get the snapshot, which already has them in it */
+        len = 32 + append_names(NULL, 0, room, CLIENT_ACTIVE, CLIENT_ACTIVE | CLIENT_PEER, "");
+        char *snapshot = (char *) pool_alloc(len);
+        len = sprintf(snapshot, "\x7f" "S%u", to);
+        append_names(snapshot, len, room, CLIENT_ACTIVE, CLIENT_ACTIVE | CLIENT_PEER, "");
+        
+        for (i = 0; i < client_counter; i++)
+            if (client_hot[i].room == room && (client_hot[i].flags & mask) == listed) {
+                queue_message(i, LANE_CONTROL, delta);
+            } else if (client_hot[i].room == room && (client_hot[i].flags & mask) == joined) {
+                queue_message(i, LANE_CONTROL, snapshot);
+                client_hot[i].flags |= CLIENT_LISTED;
+            }
+        
+        pool_free(delta);
+        pool_free(snapshot);
+    }
+    
+    for (i = 0; i < presence_leave_count; i++) {
+        intern_release(presence_leaves[i].username);
+        intern_release(presence_leaves[i].room);
+    }
+    presence_leave_count = 0;
+}
+
+void *presence_thread(void *unused) {
+    /* Wait for the first join or leave, then let more pile up for a while so a
+     * burst of churn costs each client one update */
+    pthread_mutex_lock(&client_list_mutex);
+    
+    while (1) {
+        while (!presence_dirty)
+            pthread_cond_wait(&presence_cond, &client_list_mutex);
+        pthread_mutex_unlock(&client_list_mutex);
+        
+        usleep(PRESENCE_BATCH_MS * 1000);
+        
+        pthread_mutex_lock(&client_list_mutex);
+        presence_dirty = 0;
+        flush_presence();
+    }
+    
+    return NULL;
+}
+
+void relay_transmit_buffer(thread_data_t *data) {
+    /* Have the transmit thread relay data->transmit_buffer and wait until it has.
+     * Several sources hand over at once (clients, peer links, shared rings), so
+     * wait for the slot to be free instead of overwriting another's request */
+    if (data->trace_id)
+        data->handoff_us = now_us();
+    
+    pthread_mutex_lock(&copy_buffer_mutex);
+    while (copy_from != -1)
+        pthread_cond_wait(&copy_buffer_cond, &copy_buffer_mutex);
+    
+    copy_from = data->client_id;
+    pthread_cond_broadcast(&copy_buffer_cond);
+    pthread_mutex_unlock(&copy_buffer_mutex);
+    
+    pthread_mutex_lock(&transmitted_mutex);
+    while (transmitted_from != data->client_id)
+        pthread_cond_wait(&transmitted_cond, &transmitted_mutex);
+    
+    transmitted_from = -1;
+    pthread_cond_broadcast(&transmitted_cond);
+    pthread_mutex_unlock(&transmitted_mutex);
+}
+
+int room_recipients(thread_data_t *data, int *recipients, int *slots) {
+    /* Sockets and slots of the other clients in data's room, but for local ones,
+     * which can't take a frame in pieces. Called with client_list_mutex held */
+    int count = 0, i;
+    uint16_t room = client_hot[data->client_id].room;
+    
+    for (i = 0; i < client_counter; i++)
+        if (i != data->client_id && (client_hot[i].flags & (CLIENT_ACTIVE | CLIENT_PEER)) == CLIENT_ACTIVE &&
+            client_hot[i].room == room && client_hot[i].sock_fd != -1 && !client_data[i].packet) {
+            slots[count] = i;
+            recipients[count++] = client_hot[i].sock_fd;
+        }
+    
+    return count;
+}
+
+void lock_writers(int *slots, int count, int lock) {
+    /* Keep the writer threads of slots off their sockets while a frame is written
+     * past their queues. Slots are locked in ascending order */
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        if (lock)
+            pthread_mutex_lock(&client_data[slots[i]].write_mutex);
+        else
+            pthread_mutex_unlock(&client_data[slots[i]].write_mutex);
+    }
+}
+
+int lock_recipients(thread_data_t *data, int *recipients, int *slots) {
+    /* room_recipients, with their writers locked until lock_writers unlocks them.
+     * client_list_mutex is only held around the lookups, so a slow frame holds up
+     * its recipients and nobody else. A slot that changed hands before its lock was
+     * taken is left out; one that didn't can't have its socket closed until the lock
+     * is released */
+    uint32_t generations[MAX_CLIENTS];
+    int count, kept = 0, i;
+    
+    pthread_mutex_lock(&client_list_mutex);
+    count = room_recipients(data, recipients, slots);
+    for (i = 0; i < count; i++)
+        generations[i] = client_data[slots[i]].generation;
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    lock_writers(slots, count, 1);
+    
+    pthread_mutex_lock(&client_list_mutex);
+    for (i = 0; i < count; i++) {
+        if (client_data[slots[i]].generation == generations[i] && client_hot[slots[i]].sock_fd == recipients[i]) {
+            recipients[kept] = recipients[i];
+            slots[kept++] = slots[i];
+        } else {
+            pthread_mutex_unlock(&client_data[slots[i]].write_mutex);
+        }
+    }
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    return kept;
+}
+
+long long stream_deadline(uint32_t len) {
+    /* When a frame of len bytes must have arrived */
+    return now_ms() + STREAM_TIMEOUT * 1000 + (long long) len * 1000 / STREAM_MIN_RATE;
+}
+
+int recv_before(int sock_fd, char *buffer, uint32_t len, long long deadline) {
+    /* recv_all for a sender that must finish by deadline, and never go quiet for
+     * STREAM_TIMEOUT; a byte at a time won't keep it going */
+    while (len > 0) {
+        long long left = deadline - now_ms();
+        struct pollfd pfd = { sock_fd, POLLIN, 0 };
+        if (left <= 0 || poll(&pfd, 1, left < STREAM_TIMEOUT * 1000 ? left : STREAM_TIMEOUT * 1000) <= 0)
+            return -1;
+        
+        int bytes_read = recv(sock_fd, buffer, len, 0);
+        if (bytes_read <= 0)
+            return -1;
+        
+        buffer += bytes_read;
+        len -= bytes_read;
+    }
+    
+    return 0;
+}
+
+int discard_before(int sock_fd, uint32_t len, long long deadline) {
+    /* Read and drop len bytes of a frame that won't be passed on, so the sender's
+     * framing survives */
+    char chunk[STREAM_CHUNK_SIZE];
+    
+    while (len > 0) {
+        uint32_t chunk_len = len < STREAM_CHUNK_SIZE ? len : STREAM_CHUNK_SIZE;
+        if (recv_before(sock_fd, chunk, chunk_len, deadline) == -1)
+            return -1;
+        
+        len -= chunk_len;
+    }
+    
+    return 0;
+}
+
+int stream_frame(thread_data_t *data, uint32_t data_len) {
+    /* Forward a frame bigger than MAX_FRAME_SIZE to the clients in the sender's
+     * room, one chunk at a time as it arrives, so memory stays bounded.
+     * Other traffic to the recipients waits until it's through, or frames would
+     * interleave on their sockets. Streamed frames are too big to keep for replay and
+     * stay on this server. Text is sanitized as it passes; up to 3 bytes of a
+     * character split between chunks are held back and go out with the next one.
+     * Returns -1 if the sender went away or fell below STREAM_MIN_RATE */
+    char chunk[STREAM_CHUNK_SIZE + 3];
+    int recipients[MAX_CLIENTS], slots[MAX_CLIENTS], count, result = 0, i;
+    uint32_t left = data_len, held = 0;
+    
+    /* A sender stalling mid-frame would hold the room up */
+    long long deadline = stream_deadline(data_len);
+    
+    /* A pattern can only be caught once the whole text is in, long after the
+     * first chunk went out, so with a filter nothing is streamed at all */
+    if (filter_active()) {
+        result = discard_before(data->sock_fd, data_len, deadline);
+        
+        pthread_mutex_lock(&client_list_mutex);
+        queue_message(data->client_id, LANE_CONTROL, "[info] Message too long to screen, not sent");
+        pthread_mutex_unlock(&client_list_mutex);
+        
+        pthread_mutex_lock(&draw_mutex);
+        write_in_window("[info] Dropped %u bytes from %s that were too long to screen", data_len, interned_string(data->username));
+        pthread_mutex_unlock(&draw_mutex);
+        
+        return result;
+    }
+    
+    count = lock_recipients(data, recipients, slots);
+    
+    pack_32i(data_len + LEN_FIELD_SIZE, chunk);
+    for (i = 0; i < count; i++)
+        if (send_all(recipients[i], chunk, LEN_FIELD_SIZE) == -1)
+            recipients[i] = -1;
+    
+    while (left > 0) {
+        uint32_t len = left < STREAM_CHUNK_SIZE ? left : STREAM_CHUNK_SIZE;
+        
+        /* If the sender drops out, pad the rest so the recipients stay in sync */
+        if (result == 0 && recv_before(data->sock_fd, chunk + held, len, deadline) == -1)
+            result = -1;
+        if (result == -1)
+            memset(chunk + held, 0, len);
+        
+        left -= len;
+        
+        uint32_t ready = sanitize_text(chunk, held + len, left == 0 || result == -1);
+        for (i = 0; i < count; i++)
+            if (recipients[i] != -1 && send_all(recipients[i], chunk, ready) == -1)
+                recipients[i] = -1;
+        
+        held = held + len - ready;
+        memmove(chunk, chunk + ready, held);
+    }
+    lock_writers(slots, count, 0);
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Streamed %u bytes from %s to %d clients", data_len, interned_string(data->username), count);
+    pthread_mutex_unlock(&draw_mutex);
+    
+    return result;
+}
+
+void announce_attachment(int *recipients, int count, const char *metadata, uint32_t size) {
+    /* Pass the control frame on, and the header of the body frame that follows */
+    char header[LEN_FIELD_SIZE];
+    int i;
+    
+    pack_32i(size + LEN_FIELD_SIZE, header);
+    for (i = 0; i < count; i++)
+        if (send_frame(recipients[i], metadata, strlen(metadata) + 1) == -1 ||
+            send_all(recipients[i], header, LEN_FIELD_SIZE) == -1)
+            recipients[i] = -1;
+}
+
+#ifdef __linux__
+int splice_all(int in_fd, int out_fd, uint32_t len) {
+    /* Move len bytes between a pipe and a socket inside the kernel */
+    while (len > 0) {
+        ssize_t moved = splice(in_fd, NULL, out_fd, NULL, len, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (moved <= 0)
+            return -1;
+        
+        len -= moved;
+    }
+    
+    return 0;
+}
+
+void close_pipes(int pipes[][2], int count) {
+    int i;
+    
+    for (i = 0; i < count; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+int relay_attachment_body(int sender_fd, int *recipients, int count, const char *metadata, uint32_t size,
+                          long long deadline) {
+    /* Announce the attachment, then splice the body from the sender into a pipe,
+     * tee the pipe's pages into a pipe per extra recipient and splice each pipe out
+     * to its socket. The file never enters our address space and recipients share
+     * the same pages. pipes[0] is the sender's.
+     * Returns -1 if the sender went away or ran out of time, and -2, before anything
+     * went out, if we are out of descriptors */
+    int pipes[MAX_CLIENTS + 1][2], pipe_count = 0, result = 0, i;
+    int null_fd = open("/dev/null", O_WRONLY);
+    
+    while (null_fd != -1 && pipe_count < (count > 1 ? count : 1) && pipe(pipes[pipe_count]) == 0)
+        pipe_count++;
+    
+    if (pipe_count < (count > 1 ? count : 1)) {
+        close_pipes(pipes, pipe_count);
+        if (null_fd != -1)
+            close(null_fd);
+        return -2;
+    }
+    
+    for (i = 0; i < pipe_count; i++)
+        fcntl(pipes[i][1], F_SETPIPE_SZ, ATTACHMENT_CHUNK_SIZE);
+    
+    announce_attachment(recipients, count, metadata, size);
+    
+    while (size > 0) {
+        ssize_t len = now_ms() > deadline ? -1 :
+                      splice(sender_fd, NULL, pipes[0][1], NULL,
+                             size < ATTACHMENT_CHUNK_SIZE ? size : ATTACHMENT_CHUNK_SIZE, SPLICE_F_MOVE);
+        if (len <= 0) {
+            result = -1;
+            break;
+        }
+        
+        for (i = 0; i < count - 1; i++) {
+            if (recipients[i] == -1)
+                continue;
+            
+            /* tee only duplicates page references and leaves the source pipe alone */
+            ssize_t teed = tee(pipes[0][0], pipes[i + 1][1], len, 0);
+            if (teed != len || splice_all(pipes[i + 1][0], recipients[i], teed) == -1)
+                recipients[i] = -1;
+        }
+        
+        /* The last recipient takes the source pipe's pages themselves; the
+         * source pipe is emptied into /dev/null if it's gone */
+        int last = count > 0 ? recipients[count - 1] : -1;
+        if (last != -1 && splice_all(pipes[0][0], last, len) == -1)
+            recipients[count - 1] = last = -1;
+        if (last == -1)
+            splice_all(pipes[0][0], null_fd, len);
+        
+        size -= len;
+    }
+    
+    close_pipes(pipes, pipe_count);
+    close(null_fd);
+    
+    return result;
+}
+#else
+int relay_attachment_body(int sender_fd, int *recipients, int count, const char *metadata, uint32_t size,
+                          long long deadline) {
+    /* No splice here: copy through a buffer */
+    char chunk[STREAM_CHUNK_SIZE];
+    int i;
+    
+    announce_attachment(recipients, count, metadata, size);
+    
+    while (size > 0) {
+        uint32_t len = size < STREAM_CHUNK_SIZE ? size : STREAM_CHUNK_SIZE;
+        if (recv_before(sender_fd, chunk, len, deadline) == -1)
+            return -1;
+        
+        for (i = 0; i < count; i++)
+            if (recipients[i] != -1 && send_all(recipients[i], chunk, len) == -1)
+                recipients[i] = -1;
+        
+        size -= len;
+    }
+    
+    return 0;
+}
+#endif
+
+int relay_attachment(thread_data_t *data, const char *metadata, uint32_t size) {
+    /* Pass the attachment's control frame to the room, then its body frame.
+     * The recipients' framing is lost if the body is cut short, so they are
+     * dropped when the sender goes away mid-file. Like streams, the body must
+     * arrive by stream_deadline.
+     * Returns -1 if the sender went away or sent a body of the wrong size */
+    int recipients[MAX_CLIENTS], slots[MAX_CLIENTS], count = 0, result = -1, pattern = -1, i;
+    uint32_t body_len;
+    long long deadline = stream_deadline(size);
+    const char *name = strchr(metadata, ':') + 1;
+    
+    struct timeval timeout = { STREAM_TIMEOUT, 0 }, no_timeout = { 0, 0 };
+    setsockopt(data->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    int received = recv_frame_header(data->sock_fd, &body_len) == 0 && body_len == size;
+    
+    /* The name is screened like any message; a blocked one's body is read and dropped */
+    if (received && (pattern = screen_text(name, "an attachment", interned_string(data->username))) != -1) {
+        result = discard_before(data->sock_fd, size, deadline);
+        
+        pthread_mutex_lock(&client_list_mutex);
+        queue_message(data->client_id, LANE_CONTROL, "[info] Attachment blocked");
+        pthread_mutex_unlock(&client_list_mutex);
+    } else if (received) {
+        count = lock_recipients(data, recipients, slots);
+        result = relay_attachment_body(data->sock_fd, recipients, count, metadata, size, deadline);
+        
+        if (result == -1) {
+            for (i = 0; i < count; i++)
+                if (recipients[i] != -1)
+                    shutdown(recipients[i], SHUT_RDWR);
+        }
+        lock_writers(slots, count, 0);
+    }
+    
+    setsockopt(data->sock_fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+    
+    pthread_mutex_lock(&draw_mutex);
+    if (result == -2)
+        write_in_window("[info] Couldn't relay %s from %s: %s", name,
+                        interned_string(data->username), strerror(errno));
+    else if (pattern == -1)
+        write_in_window("[info] Relayed %s (%u bytes) from %s to %d clients", name, size, interned_string(data->username), count);
+    pthread_mutex_unlock(&draw_mutex);
+    
+    return result == 0 ? 0 : -1;
+}
+
 void *client_thread_loop(void *thread_data) {
     /* process_message
      * Acquire draw mutex, draw, release
      * Repeat
      */
     thread_data_t *data = (thread_data_t *) thread_data;
+    uint32_t data_len;
+    
+    if (pinned_cpu_count > 0)
+        pin_thread(pthread_self(), data->cpu);
     
     while (1) {
-        data->transmit_buffer = process_message(data->sock_fd);
+        int header = data->packet ? recv_client_packet(data, &data_len) : recv_client_header(data, &data_len);
+        if (header == -1)
+            break;
         
-        pthread_mutex_lock(&copy_buffer_mutex);
-        copy_from = data->client_id;
-        pthread_cond_signal(&copy_buffer_cond);
-        pthread_mutex_unlock(&copy_buffer_mutex);
+        /* Handed over to a new server process */
+        if (header == 1)
+            park_client_thread(data);
         
-        pthread_mutex_lock(&transmitted_mutex);
-        while (transmitted_from != data->client_id)
-            pthread_cond_wait(&transmitted_cond, &transmitted_mutex);
+        /* Only clients may stream; a peer never sends frames this big */
+        if (data_len > MAX_FRAME_SIZE) {
+            if ((client_hot[data->client_id].flags & CLIENT_PEER) || stream_frame(data, data_len) == -1)
+                break;
+            continue;
+        }
         
-        transmitted_from = -1;
-        pthread_mutex_unlock(&transmitted_mutex);
+        data->trace_id = trace_sample();
+        long long recv_us = data->trace_id ? now_us() : 0;
+        int body = data->packet ? 0 : recv_client_body(data, data_len);
+        if (body == -1)
+            break;
+        
+        /* Handed over with part of the body, which the new process reads the rest of */
+        if (body == 1)
+            park_client_thread(data);
+        
+        data->transmit_len = data_len;
+        
+        /* The client's answer to the offer of batch frames */
+        if (!(client_hot[data->client_id].flags & CLIENT_PEER) && strcmp(data->transmit_buffer, "\x7f" "B") == 0) {
+            pthread_mutex_lock(&client_list_mutex);
+            data->batching = 1;
+            pthread_mutex_unlock(&client_list_mutex);
+            
+            pool_free(data->transmit_buffer);
+            continue;
+        }
+        
+        /* Multicast listeners: 0x7F 'J' once joined, 0x7F 'N' <first>-<last> for gaps */
+        if (!(client_hot[data->client_id].flags & CLIENT_PEER) && multicast_fd != -1 &&
+            data->transmit_buffer[0] == '\x7f' && (data->transmit_buffer[1] == 'J' || data->transmit_buffer[1] == 'N')) {
+            pthread_mutex_lock(&client_list_mutex);
+            if (data->transmit_buffer[1] == 'J')
+                multicast_join(data->client_id);
+            else
+                multicast_retransmit(data->client_id, data->transmit_buffer + 2);
+            pthread_mutex_unlock(&client_list_mutex);
+            
+            pool_free(data->transmit_buffer);
+            continue;
+        }
+        
+        /* 0x7F 'A' <size>:<name> announces a file; its body is the next frame */
+        uint32_t attachment_size;
+        if (!(client_hot[data->client_id].flags & CLIENT_PEER) &&
+            data->transmit_buffer[0] == '\x7f' && data->transmit_buffer[1] == 'A') {
+            sanitize_text(data->transmit_buffer + 2, strlen(data->transmit_buffer + 2), 1);
+            int valid = !data->packet && sscanf(data->transmit_buffer + 2, "%u:", &attachment_size) == 1 &&
+                        strchr(data->transmit_buffer, ':') != NULL && attachment_size <= MAX_ATTACHMENT_SIZE;
+            
+            if (!valid || relay_attachment(data, data->transmit_buffer, attachment_size) == -1) {
+                pool_free(data->transmit_buffer);
+                break;
+            }
+            
+            pool_free(data->transmit_buffer);
+            continue;
+        }
+        
+        /* Check the text once here, so nothing downstream has to. Private messages
+         * keep their 0x7F 'D' */
+        char *text = data->transmit_buffer;
+        if (!(client_hot[data->client_id].flags & CLIENT_PEER) && text[0] == '\x7f' && text[1] == 'D')
+            text += 2;
+        sanitize_text(text, strlen(text), 1);
+        
+        trace_record(data->trace_id, TRACE_RECV, recv_us, data->client_id);
+        relay_transmit_buffer(data);
         
         pthread_mutex_lock(&draw_mutex);
-        write_in_window(data->transmit_buffer);
+        write_in_window("%s", data->transmit_buffer);
         pthread_mutex_unlock(&draw_mutex);
         
-        free(data->transmit_buffer);
+        pool_free(data->transmit_buffer);
     }
+    
+    /* The client went away; free its slot so it can reconnect */
+    pthread_mutex_lock(&client_list_mutex);
+    int sock_fd = data->sock_fd;
+    pthread_t writer = data->writer;
+    shutdown(sock_fd, SHUT_RDWR);
+    remove_client(data->client_id);
+    pthread_mutex_unlock(&client_list_mutex);
+    
+    /* The writer, or another client's stream, may be in the middle of a frame; the
+     * descriptor can't be reused before they're done */
+    pthread_join(writer, NULL);
+    pthread_mutex_lock(&data->write_mutex);
+    close(sock_fd);
+    pthread_mutex_unlock(&data->write_mutex);
+    
+    pthread_mutex_lock(&draw_mutex);
+    write_in_window("[info] Connection closed");
+    pthread_mutex_unlock(&draw_mutex);
+    
+    pool_flush();
+    trace_release();
+    
+    return NULL;
 }
 
 void *transmit_thread(void *unused) {
     int saved_copy_from;
     
     while (1) {
+        if (busy_poll_us) {
+            long long until = now_us() + busy_poll_us;
+            while (__atomic_load_n(&copy_from, __ATOMIC_RELAXED) == -1 && now_us() < until)
+                cpu_relax();
+        }
+        
         pthread_mutex_lock(&copy_buffer_mutex);
         while (copy_from == -1)
             pthread_cond_wait(&copy_buffer_cond, &copy_buffer_mutex);
         
         pthread_mutex_lock(&client_list_mutex);
-        int i;
-        for (i = 0; i < client_counter; i++)
-            if (i != copy_from)
-                send_message(client_data[i].sock_fd, client_data[copy_from].transmit_buffer);
+        thread_data_t *source = &client_data[copy_from];
+        int source_is_peer = client_hot[copy_from].flags & CLIENT_PEER;
+        uint32_t origin, message_id;
+        const char *room = interned_string(client_hot[copy_from].room);
+        int duplicate = 0, id_len = 0, pattern = -1, direct = 0, recipients = 0;
+        
+        /* Frames queued from here on belong to the traced message, if it is */
+        trace_record(source->trace_id, TRACE_HANDOFF, source->handoff_us, copy_from);
+        trace_current = source->trace_id;
+        long long fanout_us = trace_current ? now_us() : 0;
+        
+        if (source_is_peer) {
+            /* Relayed by another server: drop it if it already went through here.
+             * Servers that predate rooms send no room, which means the lobby */
+            uint32_t text_len = strlen(source->transmit_buffer) + 1;
+            duplicate = source->transmit_len <= text_len ||
+                        sscanf(source->transmit_buffer + text_len, "%x:%u%n", &origin, &message_id, &id_len) != 2 ||
+                        already_seen(origin, message_id);
+            
+            room = "";
+            if (!duplicate && source->transmit_buffer[text_len + id_len] == ':')
+                room = source->transmit_buffer + text_len + id_len + 1;
+        } else {
+            /* Sent by one of our clients: screen it, then give it a mesh-wide id.
+             * Other servers screen their own clients */
+            pattern = screen_text(source->transmit_buffer, "a message", interned_string(source->username));
+            
+            if (pattern != -1) {
+                queue_message(copy_from, LANE_CONTROL, "[info] Message blocked");
+            } else if (source->transmit_buffer[0] == '\x7f' && source->transmit_buffer[1] == 'D') {
+                /* 0x7F 'D' <username> <text>: one send, no id, no history */
+                send_private_message(copy_from, source->transmit_buffer + 2);
+                direct = 1;
+            } else {
+                origin = node_id;
+                message_id = ++last_message_id;
+                duplicate = already_seen(origin, message_id);
+            }
+        }
+        
+        if (!duplicate && pattern == -1 && !direct) {
+            /* Number the message and keep it for clients that reconnect */
+            uint32_t seq = ++last_seq;
+            uint16_t room_id = intern(room);
+            uint32_t multicast_seq = multicast_fd != -1 ? ++interned[room_id].multicast_seq : 0;
+            record_history(seq, multicast_seq, source->username, room_id, source->transmit_buffer);
+            
+            /* Traffic of a room we own stays here. The lobby, and rooms whose clients
+             * haven't moved to the owner yet, flood to every other peer; the dedupe
+             * windows stop loops */
+            int flood = !owns_room(room) || room[0] == '\0';
+            
+            /* Publish once for the nodes on this host, and only use TCP for the rest */
+            int shared = 0;
+            if (flood) {
+                char *frame;
+                uint32_t frame_len = format_relayed_message(&frame, source->transmit_buffer, origin, message_id, room);
+                shared = ring_publish(frame, frame_len, source_is_peer ? source->peer_node_id : 0);
+                pool_free(frame);
+            }
+            
+            /* The sender listens too: a gap would make it ask for its own message */
+            int i, listeners = (client_hot[copy_from].flags & CLIENT_MULTICAST) && client_hot[copy_from].room == room_id;
+            for (i = 0; i < client_counter; i++) {
+                client_hot_t *hot = &client_hot[i];
+                
+                if (i == copy_from || !(hot->flags & CLIENT_ACTIVE) || hot->sock_fd == -1)
+                    continue;
+                
+                if (hot->flags & CLIENT_PEER) {
+                    if (flood && !(shared && ring_consumer_attached(client_data[i].peer_node_id))) {
+                        queue_relayed_message(i, source->transmit_buffer, origin, message_id, room);
+                        recipients++;
+                    }
+                } else if (hot->room == room_id && (hot->flags & CLIENT_MULTICAST)) {
+                    listeners++;
+                } else if (hot->room == room_id) {
+                    queue_sequenced_message(i, source->transmit_buffer, seq);
+                    recipients++;
+                }
+            }
+            
+            /* One send for the whole room, however many listen */
+            if (listeners > 0) {
+                multicast_send(room_id, multicast_seq, interned_string(source->username), source->transmit_buffer, seq);
+                recipients++;
+            }
+            
+            intern_release(room_id);
+        }
+        
+        trace_record(trace_current, TRACE_FANOUT, fanout_us, recipients);
+        trace_current = 0;
         pthread_mutex_unlock(&client_list_mutex);
         
         saved_copy_from = copy_from;
         copy_from = -1;
+        pthread_cond_broadcast(&copy_buffer_cond);
         pthread_mutex_unlock(&copy_buffer_mutex);
         
+        /* Don't overwrite a notification its thread hasn't picked up yet */
         pthread_mutex_lock(&transmitted_mutex);
+        while (transmitted_from != -1)
+            pthread_cond_wait(&transmitted_cond, &transmitted_mutex);
+        
         transmitted_from = saved_copy_from;
-        pthread_cond_signal(&transmitted_cond);
+        pthread_cond_broadcast(&transmitted_cond);
         pthread_mutex_unlock(&transmitted_mutex);
     }
 }
@@ -376,11 +4248,68 @@ int main(int argc, const char * argv[]) {
     /* Draw the windows */
     wrefresh(stdscr);
     
-    /* Start listen loop */
-    if (argc == 3)
-        start_server_loop(argv[1], argv[2]);
+    /* Writing to a client that just went away must not kill the server */
+    signal(SIGPIPE, SIG_IGN);
+    
+    /* Frames come from the pools, and only chat-sized frames are buffered whole */
+    transport_alloc = pool_alloc;
+    transport_free = pool_free;
+    transport_max_frame = MAX_FRAME_SIZE;
+    transport_max_stream = MAX_STREAM_SIZE;
+    
+    /* Banned terms, if any */
+    filter_path = getenv("CHAT_FILTER");
+    
+    /* Pipeline tracing, if asked for; SIGUSR1 writes out what was collected */
+    if (getenv("CHAT_TRACE"))
+        trace_every = atoi(getenv("CHAT_TRACE"));
+    signal(SIGUSR1, request_trace_dump);
+    
+    /* Low-latency mode, if asked for */
+    const char *cpu_list = getenv("CHAT_CPUS");
+    while (cpu_list && *cpu_list && pinned_cpu_count < MAX_PINNED_CPUS) {
+        char *end;
+        int first = (int) strtol(cpu_list, &end, 10), last = first;
+        if (end == cpu_list)
+            break;
+        if (*end == '-')
+            last = (int) strtol(end + 1, &end, 10);
+        
+        for (; first <= last && pinned_cpu_count < MAX_PINNED_CPUS; first++)
+            pinned_cpus[pinned_cpu_count++] = first;
+        
+        cpu_list = *end == ',' ? end + 1 : end;
+    }
+    
+    if (getenv("CHAT_BUSY_POLL"))
+        busy_poll_us = atoll(getenv("CHAT_BUSY_POLL"));
+    
+#ifdef __linux__
+    /* SIGUSR2 gets client threads out of ppoll for a hot restart. It stays blocked
+     * otherwise, here and in every thread started from here, so it can't cut a
+     * read or write short */
+    struct sigaction restart_action;
+    memset(&restart_action, 0, sizeof(restart_action));
+    restart_action.sa_handler = interrupt_wait;
+    sigaction(SIGUSR2, &restart_action, NULL);
+    
+    sigset_t restart_signal;
+    sigemptyset(&restart_signal);
+    sigaddset(&restart_signal, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &restart_signal, &restart_wait_mask);
+#endif
+    
+    /* Node id for mesh-wide message ids, and the boot id clients resume against;
+     * a hot restart takes the old process's boot id over */
+    srandom(time(NULL) ^ getpid());
+    node_id = (uint32_t) random();
+    boot_id = (uint32_t) random() | 1;
+    
+    /* Start listen loop; any extra arguments are host:port of seed servers to gossip with */
+    if (argc >= 3)
+        start_server_loop(argv[1], argv[2], argv + 3, argc - 3);
     else {
-        write_in_window("Two arguments needed - press any key to end\n");
+        write_in_window("At least two arguments needed - press any key to end\n");
         wgetch(stdscr);
     }
     
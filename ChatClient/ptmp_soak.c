@@ -0,0 +1,397 @@
+//
+//  main.c
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#include "ptmp_transport.h"
+
+/* Soak test: SOAK_WORKERS threads each connect, send MESSAGES_PER_CONNECTION
+ * messages, hang up and start over, for as long as the run lasts. Every
+ * SAMPLE_INTERVAL seconds the server's RSS, open descriptors and threads are read
+ * from /proc. Pools and history fill up during the first WARMUP_PERCENT of the
+ * samples; after that, a leak shows as growth per connection, so each series gets
+ * a least-squares slope per 1000 connections and the run fails if it's steeper
+ * than allowed */
+#define DEFAULT_DURATION 3600
+#define DEFAULT_WORKERS 16
+#define MESSAGES_PER_CONNECTION 8
+#define DRAIN_TIMEOUT 2
+#define SAMPLE_INTERVAL 5
+#define WARMUP_PERCENT 25
+#define MAX_SAMPLES 100000
+
+/* Fanout mode: FANOUT_LISTENERS clients (or $SOAK_LISTENERS) join the room and
+ * one more sends timestamped messages, FANOUT_INTERVAL_US apart so no queue
+ * builds up. Each listener takes the time every message reaches it; after the
+ * first FANOUT_WARMUP messages those latencies are sorted for the percentiles,
+ * and the run fails if a message is lost or p99 is over $SOAK_MAX_P99_US */
+#define DEFAULT_FANOUT_MESSAGES 10000
+#define FANOUT_LISTENERS 8
+#define FANOUT_INTERVAL_US 1000
+#define FANOUT_WARMUP 100
+#define FANOUT_SETTLE_US 500000
+
+#define METRIC_RSS 0
+#define METRIC_FDS 1
+#define METRIC_THREADS 2
+#define METRIC_COUNT 3
+
+typedef struct _sample_t {
+    long elapsed;
+    unsigned long connections;
+    long values[METRIC_COUNT];
+} sample_t;
+
+/* Allowed growth per 1000 connections, and the variables that override it */
+const char *metric_names[METRIC_COUNT] = { "RSS (KB)", "fds", "threads" };
+const char *metric_variables[METRIC_COUNT] = { "SOAK_MAX_RSS_SLOPE", "SOAK_MAX_FD_SLOPE", "SOAK_MAX_THREAD_SLOPE" };
+double metric_limits[METRIC_COUNT] = { 64, 1, 1 };
+
+const char *server_host, *server_port;
+sample_t samples[MAX_SAMPLES];
+
+/* Fanout latencies in microseconds, FANOUT_LISTENERS rows of fanout_messages;
+ * -1 until the message arrives */
+long long *latencies;
+int fanout_messages, fanout_run;
+
+/* Worker counters */
+volatile int stopping = 0;
+unsigned long connections = 0, messages = 0, failed_connections = 0;
+
+int connect_to_server(void) {
+    int sock_fd = transport_connect(server_host, server_port);
+    
+    /* A server that stops talking mustn't hang the worker */
+    struct timeval timeout = { DRAIN_TIMEOUT, 0 };
+    if (sock_fd != -1)
+        setsockopt(sock_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    
+    return sock_fd;
+}
+
+void drain(int sock_fd, int until_closed) {
+    /* Read and drop whatever the server sent, so its queues to us never back up */
+    char buffer[4096];
+    
+    while (recv(sock_fd, buffer, sizeof(buffer), until_closed ? 0 : MSG_DONTWAIT) > 0)
+        ;
+}
+
+void *worker_thread(void *arg) {
+    int worker = (int) (intptr_t) arg, i;
+    unsigned int round;
+    char username[32], text[128];
+    
+    for (round = 0; !stopping; round++) {
+        int sock_fd = connect_to_server();
+        if (sock_fd == -1) {
+            __atomic_add_fetch(&failed_connections, 1, __ATOMIC_RELAXED);
+            usleep(100000);
+            continue;
+        }
+        
+        /* Every connection is a new user, so the server can't reuse anything of the last one */
+        snprintf(username, sizeof(username), "soak%d-%u", worker, round);
+        int result = send_message(sock_fd, username);
+        
+        for (i = 0; i < MESSAGES_PER_CONNECTION && result == 0; i++) {
+            snprintf(text, sizeof(text), "soak message %d from %s", i, username);
+            if ((result = send_message(sock_fd, text)) == 0)
+                __atomic_add_fetch(&messages, 1, __ATOMIC_RELAXED);
+            drain(sock_fd, 0);
+        }
+        
+        /* Hang up our side, then read until the server has closed its own */
+        shutdown(sock_fd, SHUT_WR);
+        drain(sock_fd, 1);
+        close(sock_fd);
+        
+        __atomic_add_fetch(&connections, 1, __ATOMIC_RELAXED);
+    }
+    
+    return NULL;
+}
+
+long long now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+void *listener_thread(void *arg) {
+    /* Read until the last message arrives or the server goes quiet for DRAIN_TIMEOUT */
+    int sock_fd = (int) (intptr_t) arg >> 16, listener = (int) (intptr_t) arg & 0xffff;
+    long long *row = &latencies[(long) listener * fanout_messages];
+    long long sent_us;
+    int run, seq = -1;
+    char *text;
+    
+    while (seq != fanout_messages - 1 && (text = process_message(sock_fd)) != NULL) {
+        long long received_us = now_us();
+        
+        /* Anything else, like history from an earlier run or our own join, is skipped */
+        if (sscanf(text, "fanout %d %d %lld", &run, &seq, &sent_us) == 3 && run == fanout_run &&
+            seq >= 0 && seq < fanout_messages)
+            row[seq] = received_us - sent_us;
+        else
+            seq = -1;
+        transport_free(text);
+    }
+    
+    close(sock_fd);
+    return NULL;
+}
+
+int compare_latencies(const void *a, const void *b) {
+    long long x = *(const long long *) a, y = *(const long long *) b;
+    return x < y ? -1 : x > y;
+}
+
+int run_fanout(int listener_count) {
+    /* Timestamps come from CLOCK_MONOTONIC, so the harness has to run on the server's host */
+    pthread_t *listeners = malloc(listener_count * sizeof(pthread_t));
+    latencies = malloc((long) listener_count * fanout_messages * sizeof(long long));
+    fanout_run = getpid();
+    char username[32], text[128];
+    int sender, i;
+    long j;
+    
+    if (listeners == NULL || latencies == NULL) {
+        perror("malloc");
+        return 2;
+    }
+    
+    for (j = 0; j < (long) listener_count * fanout_messages; j++)
+        latencies[j] = -1;
+    
+    for (i = 0; i < listener_count; i++) {
+        int sock_fd = connect_to_server();
+        if (sock_fd == -1) {
+            perror("connect");
+            return 2;
+        }
+        
+        snprintf(username, sizeof(username), "fanout%d", i);
+        send_message(sock_fd, username);
+        pthread_create(&listeners[i], NULL, listener_thread, (void *) (intptr_t) (sock_fd << 16 | i));
+    }
+    
+    if ((sender = connect_to_server()) == -1) {
+        perror("connect");
+        return 2;
+    }
+    send_message(sender, "fanout-sender");
+    usleep(FANOUT_SETTLE_US);
+    
+    long long next_us = now_us();
+    for (i = 0; i < fanout_messages; i++) {
+        while (now_us() < next_us)
+            ;
+        next_us += FANOUT_INTERVAL_US;
+        
+        snprintf(text, sizeof(text), "fanout %d %d %lld", fanout_run, i, now_us());
+        if (send_message(sender, text) == -1) {
+            fprintf(stderr, "Lost the server after %d messages\n", i);
+            return 2;
+        }
+        drain(sender, 0);
+    }
+    
+    for (i = 0; i < listener_count; i++)
+        pthread_join(listeners[i], NULL);
+    close(sender);
+    
+    /* Pack the measured latencies to the front of the array, then sort them */
+    long count = 0, lost = 0;
+    for (i = 0; i < listener_count; i++)
+        for (j = FANOUT_WARMUP; j < fanout_messages; j++) {
+            long long latency = latencies[(long) i * fanout_messages + j];
+            if (latency == -1)
+                lost++;
+            else
+                latencies[count++] = latency;
+        }
+    
+    if (count == 0) {
+        printf("FAIL: no messages arrived after warmup\n");
+        return 1;
+    }
+    qsort(latencies, count, sizeof(long long), compare_latencies);
+    
+    long long p99 = latencies[count * 99 / 100];
+    long long max_p99 = getenv("SOAK_MAX_P99_US") ? atoll(getenv("SOAK_MAX_P99_US")) : 0;
+    int failed = lost > 0 || (max_p99 > 0 && p99 > max_p99);
+    
+    printf("%s: %ld deliveries to %d listeners, %ld lost; latency (us) p50 %lld p90 %lld p99 %lld p99.9 %lld max %lld\n",
+           failed ? "FAIL" : "ok", count, listener_count, lost, latencies[count / 2], latencies[count * 9 / 10],
+           p99, latencies[count * 999 / 1000], latencies[count - 1]);
+    
+    return failed;
+}
+
+int read_sample(int pid, sample_t *sample) {
+    /* RSS and threads from /proc/<pid>/status, fds from /proc/<pid>/fd.
+     * Returns -1 if the server is gone */
+    char path[64], line[256];
+    
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    FILE *status = fopen(path, "r");
+    if (status == NULL)
+        return -1;
+    
+    while (fgets(line, sizeof(line), status) != NULL) {
+        sscanf(line, "VmRSS: %ld", &sample->values[METRIC_RSS]);
+        sscanf(line, "Threads: %ld", &sample->values[METRIC_THREADS]);
+    }
+    fclose(status);
+    
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    DIR *fds = opendir(path);
+    if (fds == NULL)
+        return -1;
+    
+    sample->values[METRIC_FDS] = 0;
+    struct dirent *entry;
+    while ((entry = readdir(fds)) != NULL)
+        if (entry->d_name[0] != '.')
+            sample->values[METRIC_FDS]++;
+    closedir(fds);
+    
+    return 0;
+}
+
+double growth(int first, int count, int metric) {
+    /* Least-squares slope of a metric against connections, per 1000 connections */
+    double mean_x = 0, mean_y = 0, covariance = 0, variance = 0;
+    int i;
+    
+    for (i = first; i < count; i++) {
+        mean_x += samples[i].connections;
+        mean_y += samples[i].values[metric];
+    }
+    mean_x /= count - first;
+    mean_y /= count - first;
+    
+    for (i = first; i < count; i++) {
+        double dx = samples[i].connections - mean_x;
+        covariance += dx * (samples[i].values[metric] - mean_y);
+        variance += dx * dx;
+    }
+    
+    return variance > 0 ? 1000 * covariance / variance : 0;
+}
+
+int main(int argc, const char * argv[]) {
+    if (argc < 4 || argc > 5) {
+        fprintf(stderr, "Usage: %s <host> <port> <server pid> [seconds]\n"
+                "       %s <host> <port> fanout [messages]\n"
+                "Churns clients through a server and fails if its RSS, fds or threads keep\n"
+                "growing; see the SOAK_* variables for the workers and the limits. Needs /proc.\n"
+                "In fanout mode, times messages from one client to SOAK_LISTENERS others and\n"
+                "prints the percentiles; run it on the server's host\n", argv[0], argv[0]);
+        return 2;
+    }
+    
+    server_host = argv[1];
+    server_port = argv[2];
+    
+    /* A server that drops us mid-write must not kill the harness */
+    signal(SIGPIPE, SIG_IGN);
+    
+    if (strcmp(argv[3], "fanout") == 0) {
+        fanout_messages = argc == 5 ? atoi(argv[4]) : DEFAULT_FANOUT_MESSAGES;
+        if (fanout_messages <= FANOUT_WARMUP) {
+            fprintf(stderr, "Send more than %d messages\n", FANOUT_WARMUP);
+            return 2;
+        }
+        return run_fanout(getenv("SOAK_LISTENERS") ? atoi(getenv("SOAK_LISTENERS")) : FANOUT_LISTENERS);
+    }
+    
+    int pid = atoi(argv[3]);
+    long duration = argc == 5 ? atol(argv[4]) : DEFAULT_DURATION;
+    int worker_count = getenv("SOAK_WORKERS") ? atoi(getenv("SOAK_WORKERS")) : DEFAULT_WORKERS;
+    int count = 0, metric, i;
+    
+    for (metric = 0; metric < METRIC_COUNT; metric++)
+        if (getenv(metric_variables[metric]))
+            metric_limits[metric] = atof(getenv(metric_variables[metric]));
+    
+    if (read_sample(pid, &samples[0]) == -1) {
+        fprintf(stderr, "No process %d to watch\n", pid);
+        return 2;
+    }
+    
+    pthread_t *workers = malloc(worker_count * sizeof(pthread_t));
+    for (i = 0; i < worker_count; i++)
+        pthread_create(&workers[i], NULL, worker_thread, (void *) (intptr_t) i);
+    
+    printf("%8s %12s %12s %10s %8s %8s\n", "seconds", "connections", "messages", "RSS (KB)", "fds", "threads");
+    
+    time_t start = time(NULL);
+    while (time(NULL) - start < duration && count < MAX_SAMPLES) {
+        sleep(SAMPLE_INTERVAL);
+        
+        sample_t *sample = &samples[count];
+        sample->elapsed = time(NULL) - start;
+        sample->connections = __atomic_load_n(&connections, __ATOMIC_RELAXED);
+        if (read_sample(pid, sample) == -1) {
+            printf("FAIL: the server exited after %lu connections\n", sample->connections);
+            return 1;
+        }
+        
+        printf("%8ld %12lu %12lu %10ld %8ld %8ld\n", sample->elapsed, sample->connections,
+               __atomic_load_n(&messages, __ATOMIC_RELAXED), sample->values[METRIC_RSS],
+               sample->values[METRIC_FDS], sample->values[METRIC_THREADS]);
+        fflush(stdout);
+        count++;
+    }
+    
+    stopping = 1;
+    for (i = 0; i < worker_count; i++)
+        pthread_join(workers[i], NULL);
+    free(workers);
+    
+    int first = count * WARMUP_PERCENT / 100;
+    if (count - first < 3 || samples[count - 1].connections == samples[first].connections) {
+        printf("FAIL: too few samples or connections after warmup to tell\n");
+        return 1;
+    }
+    
+    if (failed_connections > 0)
+        printf("%lu connection attempts failed\n", failed_connections);
+    
+    int failed = 0;
+    for (metric = 0; metric < METRIC_COUNT; metric++) {
+        double slope = growth(first, count, metric);
+        int over = slope > metric_limits[metric];
+        
+        printf("%s: %s grows %.2f per 1000 connections (limit %.2f)\n", over ? "FAIL" : "ok",
+               metric_names[metric], slope, metric_limits[metric]);
+        failed |= over;
+    }
+    
+    return failed;
+}
@@ -0,0 +1,781 @@
+//
+//  ptmp_transport.c
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "ptmp_transport.h"
+
+/* How much transport_read asks the socket for at least */
+#define TRANSPORT_READ_CHUNK (16 * 1024)
+/* Input buffers that grew past this for a big frame are given back once it's gone */
+#define TRANSPORT_IDLE_BUFFER (4 * TRANSPORT_READ_CHUNK)
+#define TRANSPORT_EPOLL_EVENTS 64
+
+/* A peer that went away must not kill the process with SIGPIPE when a backend writes to it */
+#ifdef MSG_NOSIGNAL
+#define TRANSPORT_SEND_FLAGS MSG_NOSIGNAL
+#else
+#define TRANSPORT_SEND_FLAGS 0
+#endif
+
+typedef struct _connection_thread_data_t {
+    transport_conn_t *conn;
+    const transport_handlers_t *handlers;
+} connection_thread_data_t;
+
+void *(*transport_alloc)(size_t size) = malloc;
+void (*transport_free)(void *buffer) = free;
+
+uint32_t transport_max_frame = TRANSPORT_MAX_FRAME;
+uint32_t transport_max_stream = TRANSPORT_MAX_FRAME;
+
+void pack_32i(uint32_t value, char *buffer) {
+    *buffer = value >> 24;
+    *(buffer + 1) = value >> 16;
+    *(buffer + 2) = value >> 8;
+    *(buffer + 3) = value;
+}
+
+uint32_t unpack_32i(const char *buffer) {
+    const unsigned char *bytes = (const unsigned char *) buffer;
+    return (*(bytes + 3)) | (*(bytes + 2) << 8) | (*(bytes + 1) << 16) | ((uint32_t) *bytes << 24);
+}
+
+void pack_16i(uint16_t value, char *buffer) {
+    *buffer = value >> 8;
+    *(buffer + 1) = value;
+}
+
+uint16_t unpack_16i(const char *buffer) {
+    const unsigned char *bytes = (const unsigned char *) buffer;
+    return (*(bytes + 1)) | (*bytes << 8);
+}
+
+int send_all(int sock_fd, const char *buffer, uint32_t len) {
+    uint32_t total = 0;
+    
+    while (total < len) {
+        int bytes_written = send(sock_fd, buffer + total, len - total, 0);
+        if (bytes_written <= 0)
+            return -1;
+        
+        total += bytes_written;
+    }
+    
+    return 0;
+}
+
+int recv_all(int sock_fd, char *buffer, uint32_t len) {
+    uint32_t total = 0;
+    
+    while (total < len) {
+        int bytes_read = recv(sock_fd, buffer + total, len - total, 0);
+        if (bytes_read <= 0)
+            return -1;
+        
+        total += bytes_read;
+    }
+    
+    return 0;
+}
+
+static ssize_t send_header_and_data(int sock_fd, const char *header, uint32_t sent, const char *data, uint32_t data_len, int flags) {
+    /* One sendmsg for the length field and the data, skipping the first sent bytes of
+     * both, so frames go out without being copied behind a length field first */
+    struct iovec iov[2];
+    struct msghdr msg;
+    int count = 0;
+    
+    if (sent < LEN_FIELD_SIZE) {
+        iov[count].iov_base = (char *) header + sent;
+        iov[count].iov_len = LEN_FIELD_SIZE - sent;
+        count++;
+        sent = 0;
+    } else {
+        sent -= LEN_FIELD_SIZE;
+    }
+    
+    iov[count].iov_base = (char *) data + sent;
+    iov[count].iov_len = data_len - sent;
+    count++;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = count;
+    
+    return sendmsg(sock_fd, &msg, flags);
+}
+
+int send_frame(int sock_fd, const char *data, uint32_t data_len) {
+    char header[LEN_FIELD_SIZE];
+    uint32_t msg_len = data_len + LEN_FIELD_SIZE, total = 0;
+    
+    pack_32i(msg_len, header);
+    
+    /* Write data to wire */
+    while (total < msg_len) {
+        ssize_t bytes_written = send_header_and_data(sock_fd, header, total, data, data_len, 0);
+        if (bytes_written <= 0)
+            return -1;
+        
+        total += bytes_written;
+    }
+    
+    return 0;
+}
+
+int send_message(int sock_fd, const char *data) {
+    /* Account for NUL in the data length */
+    return send_frame(sock_fd, data, strlen(data) + 1);
+}
+
+int recv_frame_header(int sock_fd, uint32_t *data_len) {
+    /* Returns -1 if the connection was closed or the length can't be right:
+     * shorter than the length field, or longer than transport_max_stream */
+    char len_buf[LEN_FIELD_SIZE];
+    
+    if (recv_all(sock_fd, len_buf, LEN_FIELD_SIZE) == -1)
+        return -1;
+    
+    uint32_t msg_len = unpack_32i(len_buf);
+    if (msg_len < LEN_FIELD_SIZE || msg_len - LEN_FIELD_SIZE > transport_max_stream)
+        return -1;
+    
+    *data_len = msg_len - LEN_FIELD_SIZE; /* Substract 4 bytes to get the data length */
+    return 0;
+}
+
+char *recv_frame_body(int sock_fd, uint32_t data_len) {
+    /* Read straight into the message buffer, taking NUL into account */
+    char *data_buf = (char *) transport_alloc(data_len + 1);
+    
+    if (recv_all(sock_fd, data_buf, data_len) == -1) {
+        transport_free(data_buf);
+        return NULL;
+    }
+    
+    data_buf[data_len] = '\0';
+    
+    return data_buf;
+}
+
+char *process_frame(int sock_fd, uint32_t *frame_len) {
+    /* Returns NULL if the connection was closed or the frame is longer than transport_max_frame */
+    uint32_t data_len;
+    
+    if (recv_frame_header(sock_fd, &data_len) == -1 || data_len > transport_max_frame)
+        return NULL;
+    
+    char *data_buf = recv_frame_body(sock_fd, data_len);
+    
+    if (data_buf && frame_len)
+        *frame_len = data_len;
+    
+    return data_buf;
+}
+
+char *process_message(int sock_fd) {
+    return process_frame(sock_fd, NULL);
+}
+
+int transport_listen(const char *port) {
+    struct sockaddr_in local_address;
+    int sock_fd, saved_errno;
+    
+    /* Specify socket parameters */
+    memset(&local_address, 0, sizeof(local_address));
+    local_address.sin_family = AF_INET;
+    local_address.sin_port = htons(atoi(port));
+    local_address.sin_addr.s_addr = INADDR_ANY;
+    
+    /* Create a TCP socket */
+    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+        return -1;
+    
+    /* Allow socket reusing, bind and start listening. The backlog has to hold a burst of
+     * clients connecting at once, or the kernel drops their SYNs and they retry a second later */
+    int value = 1;
+    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(int)) == -1 ||
+        bind(sock_fd, (struct sockaddr *) &local_address, sizeof(local_address)) == -1 ||
+        listen(sock_fd, SOMAXCONN) == -1) {
+        saved_errno = errno;
+        close(sock_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+int transport_connect(const char *host, const char *port) {
+    /* Tries every address host resolves to */
+    struct addrinfo hints, *result, *address;
+    int sock_fd = -1, status;
+    
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    
+    if ((status = getaddrinfo(host, port, &hints, &result)) != 0) {
+        errno = status == EAI_SYSTEM ? errno : EHOSTUNREACH;
+        return -1;
+    }
+    
+    for (address = result; address != NULL; address = address->ai_next) {
+        if ((sock_fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol)) == -1)
+            continue;
+        
+        if (connect(sock_fd, address->ai_addr, address->ai_addrlen) == 0)
+            break;
+        
+        status = errno;
+        close(sock_fd);
+        errno = status;
+        sock_fd = -1;
+    }
+    
+    freeaddrinfo(result);
+    
+    return sock_fd;
+}
+
+static int local_address(const char *path, struct sockaddr_un *address) {
+    memset(address, 0, sizeof(struct sockaddr_un));
+    address->sun_family = AF_UNIX;
+    
+    if (strlen(path) >= sizeof(address->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    
+    strcpy(address->sun_path, path);
+    return 0;
+}
+
+int transport_listen_local(const char *path) {
+    /* A socket left at path by an earlier run is replaced */
+    struct sockaddr_un address;
+    int sock_fd, saved_errno;
+    
+    if (local_address(path, &address) == -1 ||
+        (sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+        return -1;
+    
+    unlink(path);
+    if (bind(sock_fd, (struct sockaddr *) &address, sizeof(address)) == -1 ||
+        listen(sock_fd, SOMAXCONN) == -1) {
+        saved_errno = errno;
+        close(sock_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+int transport_connect_local(const char *path) {
+    struct sockaddr_un address;
+    int sock_fd, saved_errno;
+    
+    if (local_address(path, &address) == -1 ||
+        (sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1)
+        return -1;
+    
+    if (connect(sock_fd, (struct sockaddr *) &address, sizeof(address)) == -1) {
+        saved_errno = errno;
+        close(sock_fd);
+        errno = saved_errno;
+        return -1;
+    }
+    
+    return sock_fd;
+}
+
+int send_packet(int sock_fd, const char *data, uint32_t data_len) {
+    /* The whole packet goes or nothing does */
+    return send(sock_fd, data, data_len, TRANSPORT_SEND_FLAGS) == (ssize_t) data_len ? 0 : -1;
+}
+
+int recv_packet(int sock_fd, char *buffer, uint32_t size, int flags) {
+    struct iovec iov = { buffer, size };
+    struct msghdr msg;
+    
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    
+    ssize_t len = recvmsg(sock_fd, &msg, flags);
+    if (len > 0 && (msg.msg_flags & MSG_TRUNC)) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    
+    return (int) len;
+}
+
+transport_conn_t *transport_open(int sock_fd, int backend) {
+    transport_conn_t *conn = (transport_conn_t *) calloc(1, sizeof(transport_conn_t));
+    
+    conn->sock_fd = sock_fd;
+    conn->backend = backend;
+    conn->poll_fd = -1;
+    pthread_mutex_init(&conn->out_mutex, NULL);
+    
+    /* Only the threads backend may block on a connection */
+    if (backend != TRANSPORT_THREADS)
+        fcntl(sock_fd, F_SETFL, fcntl(sock_fd, F_GETFL) | O_NONBLOCK);
+    
+    return conn;
+}
+
+static void uncover_input(transport_conn_t *conn) {
+    /* Put back the byte the last frame's NUL went over */
+    if (conn->in_covered) {
+        conn->in[conn->in_start] = conn->in_saved;
+        conn->in_covered = 0;
+    }
+}
+
+int transport_read(transport_conn_t *conn) {
+    uncover_input(conn);
+    
+    /* Move the partial frame to the front */
+    if (conn->in_start > 0) {
+        conn->in_len -= conn->in_start;
+        memmove(conn->in, conn->in + conn->in_start, conn->in_len);
+        conn->in_start = 0;
+    }
+    
+    if (conn->in_len == 0 && conn->in_size > TRANSPORT_IDLE_BUFFER) {
+        free(conn->in);
+        conn->in = NULL;
+        conn->in_size = 0;
+    }
+    
+    /* Always leave a spare byte past the data for the NUL of the last frame */
+    if (conn->in_size - conn->in_len < TRANSPORT_READ_CHUNK + 1) {
+        uint32_t wanted = conn->in_len + TRANSPORT_READ_CHUNK + 1;
+        conn->in_size = conn->in_size * 2 > wanted ? conn->in_size * 2 : wanted;
+        conn->in = (char *) realloc(conn->in, conn->in_size);
+    }
+    
+    ssize_t bytes_read = recv(conn->sock_fd, conn->in + conn->in_len, conn->in_size - conn->in_len - 1, MSG_DONTWAIT);
+    if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+        return 0;
+    
+    if (bytes_read > 0)
+        conn->in_len += bytes_read;
+    
+    return 1;
+}
+
+char *transport_next_frame(transport_conn_t *conn, uint32_t *frame_len) {
+    /* Frames are handed out where they lie in the input buffer. The NUL goes over the
+     * first byte of whatever follows, which is put back on the next call */
+    uncover_input(conn);
+    
+    uint32_t available = conn->in_len - conn->in_start;
+    if (available < LEN_FIELD_SIZE)
+        return NULL;
+    
+    uint32_t msg_len = unpack_32i(conn->in + conn->in_start);
+    if (msg_len < LEN_FIELD_SIZE || msg_len - LEN_FIELD_SIZE > transport_max_frame) {
+        conn->failed = 1;
+        return NULL;
+    }
+    
+    if (available < msg_len)
+        return NULL;
+    
+    char *frame = conn->in + conn->in_start + LEN_FIELD_SIZE;
+    conn->in_start += msg_len;
+    conn->in_saved = conn->in[conn->in_start];
+    conn->in_covered = 1;
+    conn->in[conn->in_start] = '\0';
+    
+    if (frame_len)
+        *frame_len = msg_len - LEN_FIELD_SIZE;
+    
+    return frame;
+}
+
+#ifdef __linux__
+static void watch_writable(transport_conn_t *conn, int writable) {
+    /* Ask epoll for EPOLLOUT only while frames are queued. Called with out_mutex held */
+    if (conn->poll_fd == -1 || conn->poll_writable == writable)
+        return;
+    
+    struct epoll_event event;
+    event.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    epoll_ctl(conn->poll_fd, EPOLL_CTL_MOD, conn->sock_fd, &event);
+    conn->poll_writable = writable;
+}
+#else
+static void watch_writable(transport_conn_t *conn, int writable) {
+}
+#endif
+
+int transport_flush(transport_conn_t *conn) {
+    /* Write what's queued until the socket is full. Returns -1 if the connection broke */
+    int result = 0;
+    
+    pthread_mutex_lock(&conn->out_mutex);
+        uint32_t total = 0;
+        while (total < conn->out_len) {
+            ssize_t bytes_written = send(conn->sock_fd, conn->out + total, conn->out_len - total, MSG_DONTWAIT | TRANSPORT_SEND_FLAGS);
+            if (bytes_written == -1) {
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+                    result = -1;
+                break;
+            }
+            
+            total += bytes_written;
+        }
+        
+        conn->out_len -= total;
+        memmove(conn->out, conn->out + total, conn->out_len);
+        
+        watch_writable(conn, conn->out_len > 0);
+    pthread_mutex_unlock(&conn->out_mutex);
+    
+    return result;
+}
+
+int transport_send(transport_conn_t *conn, const char *data, uint32_t data_len) {
+    char header[LEN_FIELD_SIZE];
+    uint32_t msg_len = data_len + LEN_FIELD_SIZE, sent = 0;
+    int result = 0;
+    
+    pack_32i(msg_len, header);
+    
+    pthread_mutex_lock(&conn->out_mutex);
+        if (conn->failed) {
+            pthread_mutex_unlock(&conn->out_mutex);
+            return -1;
+        }
+        
+        /* The threads backend blocks; the others write what the socket takes and queue the rest */
+        while (sent < msg_len && (conn->out_len == 0 || conn->backend == TRANSPORT_THREADS)) {
+            ssize_t bytes_written = send_header_and_data(conn->sock_fd, header, sent, data, data_len,
+                                                         (conn->backend == TRANSPORT_THREADS ? 0 : MSG_DONTWAIT) | TRANSPORT_SEND_FLAGS);
+            if (bytes_written == -1 && errno == EINTR)
+                continue;
+            if (bytes_written <= 0) {
+                if (bytes_written == -1 && (errno == EAGAIN || errno == EWOULDBLOCK) && conn->backend != TRANSPORT_THREADS)
+                    break;
+                
+                result = -1;
+                break;
+            }
+            
+            sent += bytes_written;
+        }
+        
+        if (result == 0 && sent < msg_len) {
+            uint32_t left = msg_len - sent;
+            
+            if (conn->out_len + left > TRANSPORT_MAX_QUEUED) {
+                result = -1;
+            } else {
+                if (conn->out_size < conn->out_len + left) {
+                    conn->out_size = conn->out_size * 2 > conn->out_len + left ? conn->out_size * 2 : conn->out_len + left;
+                    conn->out = (char *) realloc(conn->out, conn->out_size);
+                }
+                
+                if (sent < LEN_FIELD_SIZE) {
+                    memcpy(conn->out + conn->out_len, header + sent, LEN_FIELD_SIZE - sent);
+                    conn->out_len += LEN_FIELD_SIZE - sent;
+                    sent = LEN_FIELD_SIZE;
+                }
+                
+                memcpy(conn->out + conn->out_len, data + sent - LEN_FIELD_SIZE, msg_len - sent);
+                conn->out_len += msg_len - sent;
+                
+                watch_writable(conn, 1);
+            }
+        }
+        
+        /* A connection we can't write to is finished; the backend closes it */
+        if (result == -1) {
+            conn->failed = 1;
+            shutdown(conn->sock_fd, SHUT_RDWR);
+        }
+    pthread_mutex_unlock(&conn->out_mutex);
+    
+    return result;
+}
+
+int transport_send_message(transport_conn_t *conn, const char *data) {
+    return transport_send(conn, data, strlen(data) + 1);
+}
+
+void transport_close(transport_conn_t *conn) {
+    /* The backend sees the connection end like any other hangup */
+    shutdown(conn->sock_fd, SHUT_RDWR);
+}
+
+void transport_destroy(transport_conn_t *conn) {
+    pthread_mutex_destroy(&conn->out_mutex);
+    free(conn->in);
+    free(conn->out);
+    free(conn);
+}
+
+int transport_backend(const char *name) {
+    if (strcmp(name, "select") == 0)
+        return TRANSPORT_SELECT;
+#ifdef __linux__
+    if (strcmp(name, "epoll") == 0)
+        return TRANSPORT_EPOLL;
+#endif
+    if (strcmp(name, "threads") == 0)
+        return TRANSPORT_THREADS;
+    
+    return -1;
+}
+
+const char *transport_backend_name(int backend) {
+    switch (backend) {
+        case TRANSPORT_SELECT:
+            return "select";
+        case TRANSPORT_EPOLL:
+            return "epoll";
+        default:
+            return "threads";
+    }
+}
+
+static int deliver_frames(transport_conn_t *conn, const transport_handlers_t *handlers) {
+    /* Read once and hand every whole frame to on_frame. Returns 0 once the connection is over */
+    char *frame;
+    uint32_t frame_len;
+    
+    if (!transport_read(conn))
+        return 0;
+    
+    while ((frame = transport_next_frame(conn, &frame_len)) != NULL)
+        handlers->on_frame(conn, frame, frame_len);
+    
+    return !conn->failed;
+}
+
+static void finish_connection(transport_conn_t *conn, const transport_handlers_t *handlers) {
+    handlers->on_close(conn);
+    close(conn->sock_fd);
+    transport_destroy(conn);
+}
+
+static transport_conn_t *accept_connection(int listen_fd, int backend) {
+    /* Returns NULL when there's nobody left to accept */
+    int sock_fd;
+    
+    while ((sock_fd = accept(listen_fd, NULL, NULL)) == -1)
+        if (errno != EINTR && errno != ECONNABORTED)
+            return NULL;
+    
+    return transport_open(sock_fd, backend);
+}
+
+static int serve_select(int listen_fd, const transport_handlers_t *handlers) {
+    /* Connections by socket; select can't watch descriptors past FD_SETSIZE anyway */
+    transport_conn_t **conns = (transport_conn_t **) calloc(FD_SETSIZE, sizeof(transport_conn_t *));
+    transport_conn_t *conn;
+    fd_set read_sockets, write_sockets;
+    int max_fd = listen_fd, fd;
+    
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    
+    while (1) {
+        FD_ZERO(&read_sockets);
+        FD_ZERO(&write_sockets);
+        FD_SET(listen_fd, &read_sockets);
+        
+        /* Wait for writability only where frames are queued */
+        for (fd = 0; fd <= max_fd; fd++) {
+            if (conns[fd] == NULL)
+                continue;
+            
+            FD_SET(fd, &read_sockets);
+            pthread_mutex_lock(&conns[fd]->out_mutex);
+                if (conns[fd]->out_len > 0)
+                    FD_SET(fd, &write_sockets);
+            pthread_mutex_unlock(&conns[fd]->out_mutex);
+        }
+        
+        if (select(max_fd + 1, &read_sockets, &write_sockets, NULL, NULL) == -1) {
+            if (errno == EINTR)
+                continue;
+            
+            free(conns);
+            return -1;
+        }
+        
+        for (fd = 0; fd <= max_fd; fd++) {
+            if ((conn = conns[fd]) == NULL)
+                continue;
+            
+            int open = !FD_ISSET(fd, &write_sockets) || transport_flush(conn) == 0;
+            if (open && FD_ISSET(fd, &read_sockets))
+                open = deliver_frames(conn, handlers);
+            
+            if (!open) {
+                conns[fd] = NULL;
+                finish_connection(conn, handlers);
+            }
+        }
+        
+        /* Accept last, so a new connection's descriptor can't be mistaken for one that just closed */
+        if (FD_ISSET(listen_fd, &read_sockets)) {
+            while ((conn = accept_connection(listen_fd, TRANSPORT_SELECT)) != NULL) {
+                if (conn->sock_fd >= FD_SETSIZE) {
+                    close(conn->sock_fd);
+                    transport_destroy(conn);
+                    continue;
+                }
+                
+                conns[conn->sock_fd] = conn;
+                if (conn->sock_fd > max_fd)
+                    max_fd = conn->sock_fd;
+                
+                handlers->on_open(conn);
+            }
+        }
+    }
+}
+
+#ifdef __linux__
+static int serve_epoll(int listen_fd, const transport_handlers_t *handlers) {
+    struct epoll_event event, events[TRANSPORT_EPOLL_EVENTS];
+    transport_conn_t *conn;
+    int poll_fd, count, i;
+    
+    if ((poll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+        return -1;
+    
+    /* The listening socket is the one without a connection */
+    fcntl(listen_fd, F_SETFL, fcntl(listen_fd, F_GETFL) | O_NONBLOCK);
+    event.events = EPOLLIN;
+    event.data.ptr = NULL;
+    if (epoll_ctl(poll_fd, EPOLL_CTL_ADD, listen_fd, &event) == -1) {
+        close(poll_fd);
+        return -1;
+    }
+    
+    while (1) {
+        if ((count = epoll_wait(poll_fd, events, TRANSPORT_EPOLL_EVENTS, -1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            
+            close(poll_fd);
+            return -1;
+        }
+        
+        for (i = 0; i < count; i++) {
+            if ((conn = (transport_conn_t *) events[i].data.ptr) == NULL) {
+                while ((conn = accept_connection(listen_fd, TRANSPORT_EPOLL)) != NULL) {
+                    /* Registered before on_open, which may already need EPOLLOUT */
+                    conn->poll_fd = poll_fd;
+                    event.events = EPOLLIN;
+                    event.data.ptr = conn;
+                    epoll_ctl(poll_fd, EPOLL_CTL_ADD, conn->sock_fd, &event);
+                    
+                    handlers->on_open(conn);
+                }
+                continue;
+            }
+            
+            int open = !(events[i].events & EPOLLOUT) || transport_flush(conn) == 0;
+            if (open && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+                open = deliver_frames(conn, handlers);
+            
+            if (!open)
+                finish_connection(conn, handlers);
+        }
+    }
+}
+#endif
+
+static void *connection_thread(void *arg) {
+    connection_thread_data_t *thread_data = (connection_thread_data_t *) arg;
+    transport_conn_t *conn = thread_data->conn;
+    const transport_handlers_t *handlers = thread_data->handlers;
+    char *frame;
+    uint32_t frame_len;
+    
+    free(thread_data);
+    
+    /* Wait for a message to arrive */
+    while ((frame = process_frame(conn->sock_fd, &frame_len)) != NULL) {
+        handlers->on_frame(conn, frame, frame_len);
+        transport_free(frame);
+    }
+    
+    finish_connection(conn, handlers);
+    return NULL;
+}
+
+static int serve_threads(int listen_fd, const transport_handlers_t *handlers) {
+    pthread_attr_t detached_attr;
+    pthread_attr_init(&detached_attr);
+    pthread_attr_setdetachstate(&detached_attr, PTHREAD_CREATE_DETACHED);
+    
+    while (1) {
+        transport_conn_t *conn = accept_connection(listen_fd, TRANSPORT_THREADS);
+        if (conn == NULL)
+            return -1;
+        
+        handlers->on_open(conn);
+        
+        connection_thread_data_t *thread_data = (connection_thread_data_t *) malloc(sizeof(connection_thread_data_t));
+        thread_data->conn = conn;
+        thread_data->handlers = handlers;
+        
+        pthread_t thread_handle;
+        if (pthread_create(&thread_handle, &detached_attr, connection_thread, thread_data) != 0) {
+            free(thread_data);
+            finish_connection(conn, handlers);
+        }
+    }
+}
+
+int transport_serve(int listen_fd, int backend, const transport_handlers_t *handlers) {
+    switch (backend) {
+        case TRANSPORT_SELECT:
+            return serve_select(listen_fd, handlers);
+#ifdef __linux__
+        case TRANSPORT_EPOLL:
+            return serve_epoll(listen_fd, handlers);
+#endif
+        case TRANSPORT_THREADS:
+            return serve_threads(listen_fd, handlers);
+        default:
+            errno = ENOTSUP;
+            return -1;
+    }
+}
@@ -0,0 +1,135 @@
+//
+//  ptmp_transport.h
+//  ChatClient
+//
+//  Created by Itamar Ravid on 22/8/14.
+//  Copyright (c) 2014 Itamar Ravid. All rights reserved.
+//
+
+#ifndef PTMP_TRANSPORT_H
+#define PTMP_TRANSPORT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Message structure:
+ * <length> <data>
+ * Length includes all of the other fields and itself. It is a 32-bit integer.
+ */
+#define LEN_FIELD_SIZE 4
+
+/* Event backends for transport_serve */
+#define TRANSPORT_SELECT 0
+#define TRANSPORT_EPOLL 1
+#define TRANSPORT_THREADS 2
+
+/* A connection that queues more than this for a peer that doesn't read is closed */
+#define TRANSPORT_MAX_QUEUED (8 * 1024 * 1024)
+
+/* Where frame buffers come from; the broadcast server points these at its pools.
+ * Set them before the first frame goes through, and free received frames with
+ * transport_free */
+extern void *(*transport_alloc)(size_t size);
+extern void (*transport_free)(void *buffer);
+
+/* Longest frame process_frame and the backends accept, and longest length
+ * recv_frame_header accepts, so a bogus length can't make us allocate gigabytes.
+ * Both start at TRANSPORT_MAX_FRAME; programs that take bigger frames raise them */
+#define TRANSPORT_MAX_FRAME (64 * 1024)
+extern uint32_t transport_max_frame;
+extern uint32_t transport_max_stream;
+
+typedef struct _transport_conn_t {
+    int sock_fd;
+    int backend;
+    
+    /* Whatever the handlers keep per connection */
+    void *data;
+    
+    /* Bytes received that don't form a whole frame yet, from in_start to in_len.
+     * in_saved is the byte a returned frame's NUL is covering */
+    char *in;
+    uint32_t in_start, in_len, in_size;
+    char in_saved;
+    int in_covered;
+    
+    /* Frames transport_send couldn't write without blocking */
+    pthread_mutex_t out_mutex;
+    char *out;
+    uint32_t out_len, out_size;
+    
+    /* Set when the peer sent a length we won't accept */
+    int failed;
+    
+    /* The epoll instance the connection is registered with, or -1 */
+    int poll_fd;
+    int poll_writable;
+} transport_conn_t;
+
+/* Called by transport_serve. With the select and epoll backends they all run on the
+ * thread that called transport_serve; with the threads backend every connection has
+ * a thread of its own, so anything the handlers share needs a lock. frame is
+ * NUL-terminated and only valid during the call. After on_close returns, the
+ * connection is freed, so it must be gone from any list another thread sends from */
+typedef struct _transport_handlers_t {
+    void (*on_open)(transport_conn_t *conn);
+    void (*on_frame)(transport_conn_t *conn, char *frame, uint32_t frame_len);
+    void (*on_close)(transport_conn_t *conn);
+} transport_handlers_t;
+
+void pack_32i(uint32_t value, char *buffer);
+uint32_t unpack_32i(const char *buffer);
+void pack_16i(uint16_t value, char *buffer);
+uint16_t unpack_16i(const char *buffer);
+
+/* Blocking I/O; everything returns -1 if the connection was closed */
+int send_all(int sock_fd, const char *buffer, uint32_t len);
+int recv_all(int sock_fd, char *buffer, uint32_t len);
+int send_frame(int sock_fd, const char *data, uint32_t data_len);
+int send_message(int sock_fd, const char *data);
+int recv_frame_header(int sock_fd, uint32_t *data_len);
+char *recv_frame_body(int sock_fd, uint32_t data_len);
+char *process_frame(int sock_fd, uint32_t *frame_len);
+char *process_message(int sock_fd);
+
+/* Socket setup. Both return -1 with errno set on failure */
+int transport_listen(const char *port);
+int transport_connect(const char *host, const char *port);
+
+/* Local connections: AF_UNIX SOCK_SEQPACKET sockets keep message boundaries, so a
+ * frame is one packet with no length field. recv_packet returns the frame's
+ * length, 0 once the peer has closed, or -1 with errno EMSGSIZE if it didn't fit
+ * in size bytes. flags go to recvmsg */
+int transport_listen_local(const char *path);
+int transport_connect_local(const char *path);
+int send_packet(int sock_fd, const char *data, uint32_t data_len);
+int recv_packet(int sock_fd, char *buffer, uint32_t size, int flags);
+
+/* Non-blocking connections, for event loops of your own. transport_read takes
+ * whatever the socket has and returns 0 once the peer has closed;
+ * transport_next_frame then returns each whole frame received, or NULL */
+transport_conn_t *transport_open(int sock_fd, int backend);
+int transport_read(transport_conn_t *conn);
+char *transport_next_frame(transport_conn_t *conn, uint32_t *frame_len);
+int transport_flush(transport_conn_t *conn);
+void transport_destroy(transport_conn_t *conn);
+
+/* Frame data and send it, queueing what the socket won't take yet. Safe from any
+ * thread, but with the select backend it should be called from the handlers, which
+ * is when the loop looks for queued frames. Returns -1 if the connection is closing */
+int transport_send(transport_conn_t *conn, const char *data, uint32_t data_len);
+int transport_send_message(transport_conn_t *conn, const char *data);
+
+/* Ask the backend to close the connection; on_close follows */
+void transport_close(transport_conn_t *conn);
+
+/* TRANSPORT_* for "select", "epoll" or "threads", or -1 if this build has no such backend */
+int transport_backend(const char *name);
+const char *transport_backend_name(int backend);
+
+/* Accept connections on listen_fd and run the handlers for them until an error.
+ * Returns -1 with errno set */
+int transport_serve(int listen_fd, int backend, const transport_handlers_t *handlers);
+
+#endif
@@ -11,6 +11,7 @@
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <poll.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -21,10 +22,10 @@
 #include <termios.h>
 #include <curses.h>
 
-#define LEN_FIELD_SIZE 4
+#include "ptmp_transport.h"
+
+#define INPUT_BUFFER_SIZE 1024
 
-char *process_message(int sock_fd);
-void send_message(int sock_fd, const char *buf);
 void write_in_window(WINDOW *win, int *current_line, int window_height, const char *message, ...);
 
 WINDOW *chat_window;
@@ -36,119 +37,35 @@ int current_chat_line, current_input_line;
 #define write_in_chat_window(m, ...) write_in_window(chat_window, &current_chat_line, chat_height, m, ##__VA_ARGS__)
 #define write_in_input_window(m, ...) write_in_window(input_window, &current_window_line, window_height, m, ##__VA_ARGS__)
 
-void pack_32i(uint32_t value, char *buffer) {
-    *buffer = value >> 24;
-    *(buffer + 1) = value >> 16;
-    *(buffer + 2) = value >> 8;
-    *(buffer + 3) = value;
-}
-
-uint32_t unpack_32i(char *buffer) {
-    return (*(buffer + 3)) | (*(buffer + 2) << 8) | (*(buffer + 1) << 16) | (*buffer << 24);
-}
-
-void send_message(int sock_fd, const char *data) {
-    char *msg = NULL;
-
-    /* Compute lengths, account for NUL in data_len */
-    uint32_t data_len = strlen(data) + 1;
-    uint32_t msg_len = data_len + LEN_FIELD_SIZE;
-    
-    /* Allocate msg buffer and set the length */
-    msg = (char *) malloc(msg_len);
-    pack_32i(msg_len, msg);
-    
-    /* Copy data to msg buffer */
-    memcpy(msg + LEN_FIELD_SIZE, data, data_len);
-    
-    /* Write data to wire */
-    int bytes_written = 0, bytes_left = msg_len - bytes_written, total = 0;
-    while (bytes_left > 0) {
-        bytes_written = send(sock_fd, msg + total, bytes_left, 0);
-        bytes_left -= bytes_written;
-        total += bytes_left;
-    }
-}
-
-char *process_message(int sock_fd) {
-    /* Message structure:
-     * <length> <data>
-     * Length includes all of the other fields and itself. It is a 32-bit integer.
-     * Data is the data. Ignored if type == 1.
-     */
-    
-    /* Working buffer */
-    char *sock_buf = (char *) malloc(1024);
-
-    /* Another buffer we'll use later for the data field */
-    char *data_buf;
-    
-    /* Start by receiving LEN_FIELD_SIZE bytes to get the next message length */
-    memset(sock_buf, 0, 1024);
-    if (recv(sock_fd, sock_buf, LEN_FIELD_SIZE, 0) == 0) {
-        write_in_chat_window("[info] Connection closed\n");
-        endwin();
-        exit(0);
-    }
-    
-    /* Unpack length */
-    uint32_t msg_len = unpack_32i(sock_buf);
-    uint32_t data_len = msg_len - LEN_FIELD_SIZE; /* Substract 4 bytes to get the data length */
-    
-    /* Allocate another buffer for the message, take NUL into account */
-    data_buf = (char *) malloc(data_len + 1);
-    /* Various counters */
-    int bytes_read = 0, bytes_left = data_len - bytes_read, total = 0;
-
-    while (bytes_left > 0) {
-        bytes_read = recv(sock_fd, sock_buf, 1024, 0);
-
-        memcpy(data_buf + total, sock_buf, bytes_read);
-
-        bytes_left -= bytes_read;
-        total += bytes_read;
+int read_input(char *input_buffer, int *input_len) {
+    /* Consume the keys typed so far without blocking, echoing them ourselves.
+     * Returns 1 when a whole line is in input_buffer */
+    int ch;
+    
+    while ((ch = wgetch(input_window)) != ERR) {
+        if (ch == '\n' || ch == '\r' || ch == KEY_ENTER) {
+            input_buffer[*input_len] = '\0';
+            return 1;
+        } else if (ch == KEY_BACKSPACE || ch == 127 || ch == '\b') {
+            if (*input_len > 0) {
+                (*input_len)--;
+                mvwaddch(input_window, current_input_line, 2 + *input_len, ' ');
+                wmove(input_window, current_input_line, 2 + *input_len);
+            }
+        } else if (ch >= ' ' && ch < KEY_MIN && *input_len < INPUT_BUFFER_SIZE - 1) {
+            input_buffer[(*input_len)++] = ch;
+            waddch(input_window, ch);
+        }
     }
     
-    /* Add NUL-terminator */
-    data_buf[total] = '\0';
-    
-    /* Free socket buffer */
-    free(sock_buf);
-    
-    return data_buf;
+    wrefresh(input_window);
+    return 0;
 }
 
 int start_server(const char *port) {
-    struct sockaddr_in local_address, remote_address;
-    socklen_t remote_address_size;
-    
     int sock_fd, new_sock_fd;
     
-    /* Specify socket parameters */
-    local_address.sin_family = AF_INET;
-    local_address.sin_port = htons(atoi(port));
-    local_address.sin_addr.s_addr = INADDR_ANY;
-    
-    /* Create a TCP socket */
-    if ((sock_fd = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
-        perror("socket");
-        exit(-1);
-    }
-    
-    int value = 1;
-    if (setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &value, sizeof(int)) == -1) {
-        perror("setsockopt");
-        exit(-1);
-    }
-    
-    /* Bind the socket */
-    if (bind(sock_fd, (struct sockaddr *) &local_address, sizeof(local_address)) == -1) {
-        perror("bind");
-        exit(-1);
-    }
-    
-    /* Start listening */
-    if (listen(sock_fd, 2) == -1) {
+    if ((sock_fd = transport_listen(port)) == -1) {
         perror("listen");
         exit(-1);
     }
@@ -156,8 +73,7 @@ int start_server(const char *port) {
     write_in_chat_window("[info] Listening on 0.0.0.0:%s\n", port);
     
     /* Wait for a connection */
-    remote_address_size = sizeof(remote_address);
-    new_sock_fd = accept(sock_fd, (struct sockaddr *) &remote_address, &remote_address_size);
+    new_sock_fd = accept(sock_fd, NULL, NULL);
     
     write_in_chat_window("[info] Received connection");
     
@@ -168,26 +84,14 @@ int start_server(const char *port) {
 }
 
 int connect_client(const char *hostname, const char *port) {
-    int sock_fd;
-    struct addrinfo hints, *result;
-    
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-    hints.ai_flags = AI_PASSIVE;
-    
-    getaddrinfo(hostname, port, &hints, &result);
-    
-    sock_fd = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
-    if (connect(sock_fd, result->ai_addr, result->ai_addrlen) == -1) {
+    int sock_fd = transport_connect(hostname, port);
+    if (sock_fd == -1) {
         perror("connect");
         exit(-1);
     }
-
+    
     write_in_chat_window("[info] Connected\n");
     
-    freeaddrinfo(result);
-   
     return sock_fd;
 }
 
@@ -247,20 +151,74 @@ int main(int argc, const char * argv[]) {
     else
         sock_fd = connect_client(argv[1], argv[2]);
     
+    /* Read keys one at a time without blocking; we echo them ourselves */
+    cbreak();
+    noecho();
+    keypad(input_window, TRUE);
+    nodelay(input_window, TRUE);
+    wmove(input_window, current_input_line, 2);
+    wrefresh(input_window);
+    
+    char *input_buffer = (char *) malloc(INPUT_BUFFER_SIZE);
+    int input_len = 0;
+    
+    /* The socket never blocks us either; what the peer won't take yet is queued on conn */
+    transport_conn_t *conn = transport_open(sock_fd, TRANSPORT_SELECT);
+    
+    /* Wait on the keyboard and the socket together, so each side shows up as soon as it arrives */
+    struct pollfd poll_fds[2];
+    poll_fds[0].fd = STDIN_FILENO;
+    poll_fds[0].events = POLLIN;
+    poll_fds[1].fd = sock_fd;
+    poll_fds[1].events = POLLIN;
+    
     while (1) {
-        char *input_buffer = (char *) malloc(1024);
-        mvwgetstr(input_window, current_input_line, 2, input_buffer);
-        send_message(sock_fd, input_buffer);
-        write_in_chat_window(input_buffer);
-        free(input_buffer);
+        poll_fds[1].events = conn->out_len > 0 ? POLLIN | POLLOUT : POLLIN;
+        if (poll(poll_fds, 2, -1) == -1) {
+            if (errno == EINTR)
+                continue;
+            
+            endwin();
+            perror("poll");
+            exit(1);
+        }
+        
+        if ((poll_fds[1].revents & POLLOUT) && transport_flush(conn) == -1)
+            poll_fds[1].revents |= POLLHUP;
         
-        werase(input_window);
-        box(input_window, '|', '=');
-        wrefresh(input_window);
+        if (poll_fds[1].revents & ~POLLOUT) {
+            if (!transport_read(conn) || conn->failed) {
+                write_in_chat_window("[info] Connection closed\n");
+                endwin();
+                exit(0);
+            }
+            
+            char *rcvd_msg;
+            while ((rcvd_msg = transport_next_frame(conn, NULL)) != NULL)
+                write_in_chat_window("%s", rcvd_msg);
+            
+            /* A length we won't accept stops the frames; nothing after it can be read */
+            if (conn->failed) {
+                write_in_chat_window("[info] Connection closed\n");
+                endwin();
+                exit(0);
+            }
+            
+            /* Put the cursor back where the user is typing */
+            wmove(input_window, current_input_line, 2 + input_len);
+            wrefresh(input_window);
+        }
         
-        char *rcvd_msg = process_message(sock_fd);
-        write_in_chat_window(rcvd_msg);
-        free(rcvd_msg);
+        if (poll_fds[0].revents && read_input(input_buffer, &input_len)) {
+            transport_send_message(conn, input_buffer);
+            write_in_chat_window("%s", input_buffer);
+            input_len = 0;
+            
+            werase(input_window);
+            box(input_window, '|', '=');
+            wmove(input_window, current_input_line, 2);
+            wrefresh(input_window);
+        }
     }
     
     endwin();